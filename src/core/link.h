@@ -0,0 +1,94 @@
+#ifndef _DIME_LINK_H
+#define _DIME_LINK_H
+
+#include <stddef.h>
+#include <mqueue.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* one end of a connection, internal to msg_queue.c. messages keep their
+ * boundaries, each one is at most msgsize bytes.
+ *
+ * implementations:
+ *   link_mq.c   posix message queues, one syscall and one kernel copy per
+ *               message and direction
+ *   link_shm.c  a shared memory region with one ring per direction,
+ *               messages are built and read in place, eventfd wakes the
+ *               peer only when it is about to sleep
+ *   link_sock.c unix SOCK_SEQPACKET, one descriptor per client, no
+ *               RLIMIT_MSGQUEUE and nothing left behind in /dev/mqueue
+ **/
+typedef struct _DimeLink DimeLink;
+typedef struct _DimeLinkOps DimeLinkOps;
+
+struct _DimeLinkOps {
+    const char* name;
+
+    /* sends a whole message, returns 0 or -1. sends never block, errno is
+     * EAGAIN if the peer has no room for it. only link_mq orders by prio,
+     * the shm rings and sockets are fifo and ignore it, so there a higher
+     * prio message never overtakes one already sent */
+    int (*send)(DimeLink*, const char* buf, size_t size, int prio);
+    /* room for an outgoing message of up to size bytes, which is built in
+     * place and then passed to commit with its actual size. NULL if there
+     * is no room. a reservation which is never committed is dropped */
+    char* (*reserve)(DimeLink*, size_t size);
+    int (*commit)(DimeLink*, char* buf, size_t size, int prio);
+    /* bytes sent and not yet taken by the peer, an estimate for some links */
+    size_t (*queued)(DimeLink*);
+    /* polls writable once a full link has room again, -1 if there is no
+     * such fd and the sender has to retry */
+    int (*tx_fd)(DimeLink*);
+
+    /* next incoming message, NULL if there is none. it keeps valid until
+     * release() */
+    const char* (*peek)(DimeLink*, size_t* size);
+    void (*release)(DimeLink*);
+    /* the reader stopped with messages left, makes fd readable again */
+    void (*defer)(DimeLink*);
+
+    void (*free)(DimeLink*);
+};
+
+struct _DimeLink {
+    const DimeLinkOps* ops;
+    int fd; /* readable when messages may be pending, -1 for send only links */
+    size_t msgsize;
+};
+
+/* takes ownership of the queues, either one can be -1. tx is to be opened
+ * O_NONBLOCK */
+DimeLink* dime_link_mq_new(mqd_t tx, mqd_t rx, size_t msgsize);
+
+/* client side: creates the shared region and its eventfds. fds receives
+ * memfd, client to server eventfd and server to client eventfd, in the
+ * order dime_link_shm_attach expects them. the link keeps its own 
+ * descriptors, fds are to be closed once handed over */
+DimeLink* dime_link_shm_new(size_t msgsize, int fds[3]);
+/* server side: maps the region a client created. takes ownership of fds
+ * on success */
+DimeLink* dime_link_shm_attach(int fds[3], size_t msgsize);
+
+/* a connected SOCK_SEQPACKET socket, owned by the link */
+DimeLink* dime_link_sock_new(int fd, size_t msgsize);
+
+/* every link starts on the server's abstract unix SOCK_SEQPACKET socket: 
+ * the client sends one handoff message, with the fds of a shm link if 
+ * it wants one. the socket then carries the messages of a sock link, or 
+ * stays open so the server sees the client hang up.
+ **/
+#define DIME_LINK_MAX_FDS 3
+
+int dime_link_listen(const char* name);
+/* returns the connected socket */
+int dime_link_connect(const char* name, const void* msg, size_t size, const int* fds, int nfds);
+/* returns a non-blocking socket of one client, and the client's pid from 
+ * SO_PEERCRED. clients of other users are turned away with errno EACCES */
+int dime_link_accept(int listener, int* pid);
+/* reads the handoff of an accepted socket, 1 if it is not there yet */
+int dime_link_handoff(int fd, void* msg, size_t size, int* fds, int* nfds);
+
+G_END_DECLS
+
+#endif /* ifndef _DIME_LINK_H */
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "link.h"
+#include "log.h"
+
+#ifdef G_LOG_DOMAIN
+#undef G_LOG_DOMAIN
+#endif
+#define G_LOG_DOMAIN "mq"
+
+typedef struct _DimeMqLink {
+    DimeLink base;
+    mqd_t tx;
+    mqd_t rx;
+    char *txbuf; /* message being built */
+    char *rxbuf; /* message received */
+} DimeMqLink;
+
+static int mq_link_send(DimeLink* l, const char* buf, size_t size, int prio)
+{
+    DimeMqLink* ml = (DimeMqLink*)l;
+
+    // the queue orders by prio, then fifo
+    if (mq_send(ml->tx, buf, size, prio) < 0) {
+        if (errno != EAGAIN) dime_warn("mq_send failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static char* mq_link_reserve(DimeLink* l, size_t size)
+{
+    return size <= l->msgsize ? ((DimeMqLink*)l)->txbuf : NULL;
+}
+
+static int mq_link_commit(DimeLink* l, char* buf, size_t size, int prio)
+{
+    return mq_link_send(l, buf, size, prio);
+}
+
+static size_t mq_link_queued(DimeLink* l)
+{
+    DimeMqLink* ml = (DimeMqLink*)l;
+
+    // messages are counted as full size
+    struct mq_attr attr;
+    if (ml->tx < 0 || mq_getattr(ml->tx, &attr) < 0) return 0;
+    return attr.mq_curmsgs * l->msgsize;
+}
+
+static int mq_link_tx_fd(DimeLink* l)
+{
+    return ((DimeMqLink*)l)->tx;
+}
+
+static const char* mq_link_peek(DimeLink* l, size_t* size)
+{
+    DimeMqLink* ml = (DimeMqLink*)l;
+
+    ssize_t nread = mq_receive(ml->rx, ml->rxbuf, l->msgsize, NULL);
+    if (nread > 0) {
+        *size = nread;
+        return ml->rxbuf;
+    }
+
+    if (nread < 0 && errno != EAGAIN) {
+        dime_warn("mq_receive failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+static void mq_link_release(DimeLink* l)
+{
+}
+
+static void mq_link_defer(DimeLink* l)
+{
+    // level triggered, the queue stays readable
+}
+
+static void mq_link_free(DimeLink* l)
+{
+    DimeMqLink* ml = (DimeMqLink*)l;
+    if (ml->tx >= 0) mq_close(ml->tx);
+    if (ml->rx >= 0) mq_close(ml->rx);
+    free(ml->txbuf);
+    free(ml->rxbuf);
+    free(ml);
+}
+
+static const DimeLinkOps mq_link_ops = {
+    .name = "mq",
+    .send = mq_link_send,
+    .reserve = mq_link_reserve,
+    .commit = mq_link_commit,
+    .queued = mq_link_queued,
+    .tx_fd = mq_link_tx_fd,
+    .peek = mq_link_peek,
+    .release = mq_link_release,
+    .defer = mq_link_defer,
+    .free = mq_link_free,
+};
+
+DimeLink* dime_link_mq_new(mqd_t tx, mqd_t rx, size_t msgsize)
+{
+    DimeMqLink* ml = (DimeMqLink*)calloc(1, sizeof(DimeMqLink));
+    ml->base.ops = &mq_link_ops;
+    ml->base.fd = rx;
+    ml->base.msgsize = msgsize;
+    ml->tx = tx;
+    ml->rx = rx;
+    if (tx >= 0) ml->txbuf = (char*)malloc(msgsize);
+    if (rx >= 0) ml->rxbuf = (char*)malloc(msgsize);
+    return &ml->base;
+}
@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "link.h"
+#include "log.h"
+
+#ifdef G_LOG_DOMAIN
+#undef G_LOG_DOMAIN
+#endif
+#define G_LOG_DOMAIN "mq"
+
+#define SHM_MAGIC 0x44494d52 /* DIMR */
+#define SHM_VERSION 1
+#define RING_SIZE 8192 /* power of 2, holds at least a dozen full messages */
+#define RING_WRAP 0xffffffffu
+#define CACHELINE 64
+
+/* a record is an 8 byte header and the message, 8 bytes aligned so
+ * messages can be used in place */
+#define RECORD_HDR 8
+#define RECORD_SIZE(n) (((n) + RECORD_HDR + 7) & ~(size_t)7)
+
+/* single producer, single consumer. head and tail run freely and are masked
+ * into data. a record which does not fit before the end of data is put at
+ * its start, behind a RING_WRAP header.
+ *
+ * wake is set by the consumer before it sleeps on its eventfd. the producer
+ * publishes head and then only signals if it takes wake back, so while the
+ * consumer is busy messages cost no syscall at all. */
+typedef struct {
+    uint32_t head __attribute__((aligned(CACHELINE))); /* producer */
+    uint32_t tail __attribute__((aligned(CACHELINE))); /* consumer */
+    uint32_t wake __attribute__((aligned(CACHELINE)));
+    char data[RING_SIZE] __attribute__((aligned(CACHELINE)));
+} DimeRing;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    DimeRing up; /* client to server */
+    DimeRing down; /* server to client */
+} DimeShmRegion;
+
+typedef struct _DimeShmLink {
+    DimeLink base;
+    DimeShmRegion* shm;
+    DimeRing* tx;
+    DimeRing* rx;
+    int tx_fd; /* eventfd of the peer */
+    uint32_t rx_len; /* of the message being peeked */
+} DimeShmLink;
+
+static inline uint32_t _load(uint32_t* p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void _store(uint32_t* p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t* _header(DimeRing* r, uint32_t pos)
+{
+    return (uint32_t*)(r->data + (pos & (RING_SIZE - 1)));
+}
+
+static char* ring_reserve(DimeRing* r, size_t size)
+{
+    uint32_t need = RECORD_SIZE(size);
+    uint32_t head = r->head;
+    uint32_t room = RING_SIZE - (head - _load(&r->tail));
+    uint32_t off = head & (RING_SIZE - 1);
+    uint32_t left = RING_SIZE - off;
+
+    if (left < need) {
+        if (room < left + need) return NULL;
+        *_header(r, head) = RING_WRAP; // not visible before commit
+        return r->data + RECORD_HDR;
+    }
+
+    if (room < need) return NULL;
+    return r->data + off + RECORD_HDR;
+}
+
+static void ring_commit(DimeRing* r, char* buf, size_t size)
+{
+    uint32_t head = r->head;
+    uint32_t off = head & (RING_SIZE - 1);
+    if (buf != r->data + off + RECORD_HDR) {
+        head += RING_SIZE - off;
+    }
+
+    *_header(r, head) = size;
+    _store(&r->head, head + RECORD_SIZE(size));
+}
+
+/* the peer can write anything into the region, so whatever is read from it
+ * is checked to stay inside data */
+static const char* ring_peek(DimeRing* r, uint32_t* size)
+{
+    uint32_t tail = r->tail;
+    uint32_t head = _load(&r->head);
+    if (tail == head) return NULL;
+
+    uint32_t len = *_header(r, tail);
+    if (len == RING_WRAP) {
+        // the wrapped record is committed along with its marker
+        tail += RING_SIZE - (tail & (RING_SIZE - 1));
+        _store(&r->tail, tail);
+        len = *_header(r, tail);
+    }
+
+    if (head - tail > RING_SIZE || len > RING_SIZE - RECORD_HDR - (tail & (RING_SIZE - 1))) {
+        dime_warn("corrupted ring");
+        return NULL;
+    }
+
+    *size = len;
+    return r->data + (tail & (RING_SIZE - 1)) + RECORD_HDR;
+}
+
+static void ring_release(DimeRing* r, uint32_t size)
+{
+    _store(&r->tail, r->tail + RECORD_SIZE(size));
+}
+
+static void _signal(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        dime_warn("eventfd write failed: %s", strerror(errno));
+    }
+}
+
+static int shm_link_commit(DimeLink* l, char* buf, size_t size, int prio)
+{
+    DimeShmLink* sl = (DimeShmLink*)l;
+    ring_commit(sl->tx, buf, size);
+
+    // pairs with the fence in shm_link_peek: either the consumer sees the
+    // new head, or we see it asleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&sl->tx->wake, 0, __ATOMIC_ACQ_REL)) {
+        _signal(sl->tx_fd);
+    }
+    return 0;
+}
+
+static char* shm_link_reserve(DimeLink* l, size_t size)
+{
+    if (size > l->msgsize) return NULL;
+    return ring_reserve(((DimeShmLink*)l)->tx, size);
+}
+
+/* the ring is fifo, prio is not used */
+static int shm_link_send(DimeLink* l, const char* buf, size_t size, int prio)
+{
+    char* p = shm_link_reserve(l, size);
+    if (!p) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memcpy(p, buf, size);
+    return shm_link_commit(l, p, size, prio);
+}
+
+static size_t shm_link_queued(DimeLink* l)
+{
+    DimeRing* r = ((DimeShmLink*)l)->tx;
+    return (uint32_t)(__atomic_load_n(&r->head, __ATOMIC_RELAXED) - 
+            __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+/* the consumer does not signal freed room */
+static int shm_link_tx_fd(DimeLink* l)
+{
+    return -1;
+}
+
+static const char* shm_link_peek(DimeLink* l, size_t* size)
+{
+    DimeShmLink* sl = (DimeShmLink*)l;
+
+    const char* p = ring_peek(sl->rx, &sl->rx_len);
+    if (p) {
+        *size = sl->rx_len;
+        return p;
+    }
+
+    // about to sleep: consume pending signals, then announce it and look
+    // once more in case the producer did not see it
+    uint64_t n;
+    if (read(l->fd, &n, sizeof n) < 0 && errno != EAGAIN) {
+        dime_warn("eventfd read failed: %s", strerror(errno));
+    }
+    __atomic_store_n(&sl->rx->wake, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    p = ring_peek(sl->rx, &sl->rx_len);
+    if (p) *size = sl->rx_len;
+    return p;
+}
+
+static void shm_link_release(DimeLink* l)
+{
+    DimeShmLink* sl = (DimeShmLink*)l;
+    ring_release(sl->rx, sl->rx_len);
+}
+
+static void shm_link_defer(DimeLink* l)
+{
+    _signal(l->fd);
+}
+
+static void shm_link_free(DimeLink* l)
+{
+    DimeShmLink* sl = (DimeShmLink*)l;
+    munmap(sl->shm, sizeof(DimeShmRegion));
+    close(sl->tx_fd);
+    close(l->fd);
+    free(sl);
+}
+
+static const DimeLinkOps shm_link_ops = {
+    .name = "shm",
+    .send = shm_link_send,
+    .reserve = shm_link_reserve,
+    .commit = shm_link_commit,
+    .queued = shm_link_queued,
+    .tx_fd = shm_link_tx_fd,
+    .peek = shm_link_peek,
+    .release = shm_link_release,
+    .defer = shm_link_defer,
+    .free = shm_link_free,
+};
+
+static DimeLink* _shm_link(DimeShmRegion* shm, int server, int rx_fd, int tx_fd, size_t msgsize)
+{
+    DimeShmLink* sl = (DimeShmLink*)calloc(1, sizeof(DimeShmLink));
+    sl->base.ops = &shm_link_ops;
+    sl->base.fd = rx_fd;
+    sl->base.msgsize = msgsize;
+    sl->shm = shm;
+    sl->tx = server ? &shm->down : &shm->up;
+    sl->rx = server ? &shm->up : &shm->down;
+    sl->tx_fd = tx_fd;
+    return &sl->base;
+}
+
+DimeLink* dime_link_shm_new(size_t msgsize, int fds[3])
+{
+    g_return_val_if_fail(RECORD_SIZE(msgsize) * 2 <= RING_SIZE, NULL);
+
+    fds[0] = memfd_create("dime-link", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0) {
+        dime_warn("can not create shm link: %s", strerror(errno));
+        goto _error;
+    }
+
+    if (ftruncate(fds[0], sizeof(DimeShmRegion)) < 0) {
+        dime_warn("ftruncate failed: %s", strerror(errno));
+        goto _error;
+    }
+    // the server maps what we hand over, it must not shrink under it
+    fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    DimeShmRegion* shm = (DimeShmRegion*)mmap(NULL, sizeof(DimeShmRegion),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm == MAP_FAILED) {
+        dime_warn("mmap failed: %s", strerror(errno));
+        goto _error;
+    }
+
+    shm->magic = SHM_MAGIC;
+    shm->version = SHM_VERSION;
+    shm->up.wake = 1;
+    shm->down.wake = 1;
+
+    // our ends are dup'ed, fds are closed once handed over
+    int rx_fd = dup(fds[2]), tx_fd = dup(fds[1]);
+    return _shm_link(shm, 0, rx_fd, tx_fd, msgsize);
+
+_error:
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+    }
+    return NULL;
+}
+
+DimeLink* dime_link_shm_attach(int fds[3], size_t msgsize)
+{
+    struct stat st;
+    if (fstat(fds[0], &st) < 0 || (size_t)st.st_size < sizeof(DimeShmRegion)) {
+        dime_warn("bad shm region");
+        return NULL;
+    }
+
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        dime_warn("shm region is not sealed");
+        return NULL;
+    }
+
+    DimeShmRegion* shm = (DimeShmRegion*)mmap(NULL, sizeof(DimeShmRegion),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shm == MAP_FAILED) {
+        dime_warn("mmap failed: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (shm->magic != SHM_MAGIC || shm->version != SHM_VERSION) {
+        dime_warn("bad shm region");
+        munmap(shm, sizeof(DimeShmRegion));
+        return NULL;
+    }
+
+    close(fds[0]);
+    return _shm_link(shm, 1, fds[1], fds[2], msgsize);
+}
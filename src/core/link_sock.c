@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/sockios.h>
+
+#include "link.h"
+#include "log.h"
+
+#ifdef G_LOG_DOMAIN
+#undef G_LOG_DOMAIN
+#endif
+#define G_LOG_DOMAIN "mq"
+
+typedef struct _DimeSockLink {
+    DimeLink base;
+    char *txbuf;
+    char *rxbuf;
+} DimeSockLink;
+
+static int sock_link_send(DimeLink* l, const char* buf, size_t size, int prio)
+{
+    if (send(l->fd, buf, size, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        if (errno != EAGAIN) dime_warn("send failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static char* sock_link_reserve(DimeLink* l, size_t size)
+{
+    return size <= l->msgsize ? ((DimeSockLink*)l)->txbuf : NULL;
+}
+
+static int sock_link_commit(DimeLink* l, char* buf, size_t size, int prio)
+{
+    return sock_link_send(l, buf, size, prio);
+}
+
+static size_t sock_link_queued(DimeLink* l)
+{
+    int n = 0;
+    if (ioctl(l->fd, SIOCOUTQ, &n) < 0) return 0;
+    return n;
+}
+
+static int sock_link_tx_fd(DimeLink* l)
+{
+    return l->fd;
+}
+
+static const char* sock_link_peek(DimeLink* l, size_t* size)
+{
+    DimeSockLink* sl = (DimeSockLink*)l;
+
+    // a longer datagram is truncated and then rejected as malformed
+    ssize_t nread = recv(l->fd, sl->rxbuf, l->msgsize, MSG_DONTWAIT);
+    if (nread > 0) {
+        *size = nread;
+        return sl->rxbuf;
+    }
+
+    // 0 is the peer closing, the watch sees the hangup
+    if (nread < 0 && errno != EAGAIN) {
+        dime_warn("recv failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+static void sock_link_release(DimeLink* l)
+{
+}
+
+static void sock_link_defer(DimeLink* l)
+{
+    // level triggered, the socket stays readable
+}
+
+static void sock_link_free(DimeLink* l)
+{
+    DimeSockLink* sl = (DimeSockLink*)l;
+    close(l->fd);
+    free(sl->txbuf);
+    free(sl->rxbuf);
+    free(sl);
+}
+
+static const DimeLinkOps sock_link_ops = {
+    .name = "sock",
+    .send = sock_link_send,
+    .reserve = sock_link_reserve,
+    .commit = sock_link_commit,
+    .queued = sock_link_queued,
+    .tx_fd = sock_link_tx_fd,
+    .peek = sock_link_peek,
+    .release = sock_link_release,
+    .defer = sock_link_defer,
+    .free = sock_link_free,
+};
+
+DimeLink* dime_link_sock_new(int fd, size_t msgsize)
+{
+    DimeSockLink* sl = (DimeSockLink*)calloc(1, sizeof(DimeSockLink));
+    sl->base.ops = &sock_link_ops;
+    sl->base.fd = fd;
+    sl->base.msgsize = msgsize;
+    sl->txbuf = (char*)malloc(msgsize);
+    sl->rxbuf = (char*)malloc(msgsize);
+    return &sl->base;
+}
+
+static socklen_t _address(const char* name, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    // abstract namespace, nothing is left on disk
+    size_t n = MIN(strlen(name), sizeof(addr->sun_path) - 1);
+    memcpy(addr->sun_path + 1, name, n);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+int dime_link_listen(const char* name)
+{
+    struct sockaddr_un addr;
+    socklen_t len = _address(name, &addr);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, len) < 0 || listen(fd, SOMAXCONN) < 0) {
+        dime_warn("listen on %s failed: %s", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int dime_link_connect(const char* name, const void* msg, size_t size, const int* fds, int nfds)
+{
+    struct sockaddr_un addr;
+    socklen_t len = _address(name, &addr);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, len) < 0) {
+        dime_debug("connect to %s failed: %s", name, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    char cbuf[CMSG_SPACE(DIME_LINK_MAX_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = (void*)msg, .iov_len = size };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+    if (nfds > 0) {
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+
+    if (sendmsg(fd, &mh, MSG_NOSIGNAL) < 0) {
+        dime_warn("handoff failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int dime_link_accept(int listener, int* pid)
+{
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        if (errno != EAGAIN) dime_warn("accept failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof cred;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        dime_warn("SO_PEERCRED failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // the socket is abstract, anyone on the host can connect
+    if (cred.uid != geteuid()) {
+        dime_warn("reject pid %d of uid %d", cred.pid, cred.uid);
+        close(fd);
+        errno = EACCES;
+        return -1;
+    }
+
+    *pid = cred.pid;
+    return fd;
+}
+
+int dime_link_handoff(int fd, void* msg, size_t size, int* fds, int* nfds)
+{
+    char cbuf[CMSG_SPACE(DIME_LINK_MAX_FDS * sizeof(int))];
+    struct iovec iov = { .iov_base = msg, .iov_len = size };
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf,
+        .msg_controllen = sizeof cbuf,
+    };
+
+    *nfds = 0;
+    ssize_t n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n < 0 && errno == EAGAIN) {
+        return 1;
+    }
+
+    struct cmsghdr* cm = n > 0 ? CMSG_FIRSTHDR(&mh) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        *nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+    }
+
+    if (n <= 0 || (mh.msg_flags & (MSG_CTRUNC | MSG_TRUNC))) {
+        for (int i = 0; i < *nfds; i++) close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    return 0;
+}
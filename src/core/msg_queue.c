@@ -7,14 +7,20 @@
 #include <time.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <signal.h>
+#include <dirent.h>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <mqueue.h>
 
 #include <glib.h>
 
 #include "msg_queue.h"
+#include "link.h"
 #include "log.h"
 
 
@@ -27,12 +33,37 @@
 #endif
 #define G_LOG_DOMAIN "mq"
 
-//FIXME: NOTE: we need to be care when choosing these constants. since mq_open may 
+//NOTE: we need to be care when choosing these constants. since mq_open may 
 //fail with EMFILE (which can be actually caused by RLIMIT_MSGQUEUE). with these 
-//settings we can handle over 100 connections which is sufficient as far as I can see.
+//settings mq links top out at about 100 connections, shm and sock links are 
+//only bound by RLIMIT_NOFILE.
 #define MSG_BUF_SIZE 512  /* this is big enough to hold any message */
 #define MSG_MAX_NR 6
 
+/* most messages handled per wakeup, so one busy queue can not starve other 
+ * sources of the main loop. what is left is handled on the next iteration. */
+#define MSG_DRAIN_MAX 32
+/* how long a sync request waits for its reply */
+#define MSG_SYNC_TIMEOUT 1000 /* ms */
+
+/* DIME_TRANSPORT picks how a client talks to the server: "shm", "sock" or 
+ * "mq". by default they are tried in that order */
+#define DIME_TRANSPORT_ENV "DIME_TRANSPORT"
+
+/* messages a connection holds while its queue is full. a client which lets
+ * it overflow is taken as hung and dropped. shm links do not tell when 
+ * there is room again and are retried every BACKLOG_RETRY */
+#define BACKLOG_MAX 64
+#define BACKLOG_RETRY 10 /* ms */
+
+/* mq clients are only known by the pid they claim. a pidfd tells when it
+ * exits, without one the pid is checked every REAP_INTERVAL */
+#define REAP_INTERVAL 30 /* s */
+
+/* a full MSG_PREEDIT after this many deltas, so a client which lost track
+ * of its preedit is not stuck with it for long */
+#define PREEDIT_SYNC_EVERY 32
+
 #define CLIENT_MAGIC 0xfadeceed
 
 typedef struct _DimeClientState {
@@ -40,23 +71,62 @@ typedef struct _DimeClientState {
     int enabled: 1;
 } DimeClientState;
 
+/* the last preedit a token was sent, deltas are made against it */
+typedef struct _DimePreeditState {
+    GString *text; /* NULL if the client may not have it */
+    int deltas; /* sent since the last full preedit */
+    uint32_t seq; /* of the last reply, candidates are stamped with it */
+} DimePreeditState;
+
+/* a token is the index of its slot with the generation of the slot when it
+ * was handed out, so a released token is not mistaken for the next one in
+ * the same slot. the generation never is 0 and neither is a token, it is 
+ * kept to 15 bits so tokens stay positive as int */
+#define TOKEN_SLOT_BITS 16
+#define TOKEN_SLOT_MAX (1 << TOKEN_SLOT_BITS)
+#define TOKEN_GEN_MAX 0x7fff
+#define TOKEN_NO_SLOT UINT32_MAX
+
+/* everything the server keeps per token, one lookup away */
+typedef struct _DimeTokenSlot {
+    uint16_t generation;
+    uint16_t used;
+    uint32_t next_free;
+    struct _DimeServerConnection *conn;
+    DimePreeditState preedit;
+} DimeTokenSlot;
+
 struct _DimeServer {
-    uint32_t initial; /* increment */
-    uint32_t last;
     mqd_t mq;
     char mq_name[NAME_MAX];
-    char *msgbuf;
-    long msgsize;
+    DimeLink *link; /* receives from all mq connections */
 
     GIOChannel *ch;
     guint watch_id;
 
-    GHashTable *connections;
-    GHashTable *token_map; /* <token, id> */
+    int listener; /* where shm and sock links start */
+    GIOChannel *listen_ch;
+    guint listen_watch_id;
+
+    GHashTable *connections; /* <id, DimeServerConnection> */
+    DimeTokenSlot *slots;
+    uint32_t nslots; /* ever used */
+    uint32_t slots_cap;
+    uint32_t free_slot; /* released ones are reused first */
+    /* connection of the message being dispatched, NULL for mq ones which 
+     * are only known by the id they claim */
+    struct _DimeServerConnection *current;
 
     DimeServerCallbacks* callbacks;
 
     DimeClientState active; /* current focus client */
+    /* keys of one token, held until a message which can not be merged 
+     * comes or the drain ends. count is 0 if there are none */
+    DimeMessageInputBatch batch;
+
+    DimeDrainStats stats;
+    DimeSendStats sent; /* of all connections */
+    guint reap_id;
 };
 
 /* connection state */
@@ -66,27 +136,75 @@ enum {
     CONN_ESTABLISHED,
 };
 
+/* a client process as seen by the server. shm and sock connections are 
+ * identified by the pid SO_PEERCRED reports, mq ones by the pid they claim */
+typedef struct _DimeServerConnection {
+    int id;
+    DimeServer *server;
+    DimeLink *link;
+
+    /* incoming messages */
+    GIOChannel *ch;
+    guint watch_id;
+
+    /* the socket the connection started on, until the handoff. shm links
+     * keep it to see the client hang up, sock links take it over */
+    int sock;
+    GIOChannel *sock_ch;
+    guint sock_watch_id;
+
+    /* messages which found the link full, sent in order before any new 
+     * one. the watch waits for room, ch is NULL if it is a timer */
+    GQueue backlog;
+    GIOChannel *out_ch;
+    guint out_watch_id;
+    char *scratch; /* where messages are built while the link is full */
+    guint drop_id; /* set once the connection is to be reaped */
+
+    /* of mq connections, their queue is unlinked once the handshake is
+     * answered */
+    char *mq_name;
+    int pidfd;
+    GIOChannel *pid_ch;
+    guint pid_watch_id;
+} DimeServerConnection;
+
+typedef struct _DimeBacklogItem {
+    size_t size;
+    char buf[];
+} DimeBacklogItem;
+
 typedef struct _DimeConnection {
     int id;
 
     int8_t state;
 
     char mq_name[NAME_MAX];
-    mqd_t mq_srv; /* send request */
-
     char mq_msg_name[NAME_MAX];
-    mqd_t mq_msg; /* receive messages */
 
-    char *msgbuf;
-    long msgsize;
+    DimeLink *link;
+    int sock; /* handoff socket of shm links, -1 otherwise */
+    GIOChannel *sock_ch; /* sees the server hang up on shm links */
+    guint sock_watch_id;
 
     GIOChannel *ch;
     guint watch_id;
 
-    GSList *clients; /* optimize DS later */
+    /* clients may be used from any thread, each one by one thread at a time.
+     * messages are built on the stack of the sending thread, only handing
+     * them to the link is serialized. one thread receives at a time, the
+     * main loop or a sync request, and callbacks run on it. */
+    GMutex send_lock;
+    GMutex recv_lock;
+
+    GRecMutex lock; /* clients and pending, held while callbacks run */
+    GHashTable *clients; /* <token, DimeClient> */
+    GHashTable *pending; /* clients waiting for their token */
+
+    DimeDrainStats stats;
+    DimeSendStats sent;
 } DimeConnection;
 
-//FIXME: clients <-> mq map
 struct _DimeClient {
     uint32_t magic;
     uint32_t token; /* if token is 0, means token is not requested from server, 
@@ -94,6 +212,25 @@ struct _DimeClient {
     int enabled: 1;
     int focused: 1;
 
+    uint32_t seq; /* of the last key sent */
+    uint32_t acked; /* of the last key replied, set by the receiving thread */
+    uint32_t syncs; /* sync requests other than keys sent */
+    uint32_t synced; /* of them answered, set by the receiving thread */
+
+    GString* preedit; /* rebuilt from deltas */
+    gboolean preedit_lost; /* a delta did not fit, wait for a full preedit */
+
+    /* a page of candidates being put together from several messages */
+    GString* cands;
+    uint16_t cands_offsets[DIME_CANDIDATES_MAX];
+    int cands_page;
+    int cands_got; /* -1 if none is */
+
+    /* the latest cursor which found the queue full, it goes out with the
+     * next message of the client */
+    DimeMessageCursor cursor;
+    gboolean cursor_held;
+
     DimeMessageCallbacks* callbacks;
 
     DimeConnection* conn; /* shared connection between all clients from one context */
@@ -108,11 +245,15 @@ static const char* g_msgname[MSG_MAX] = {
     /*MSG_DEL_IC,*/         "DEL_IC",
     /*MSG_CURSOR,*/         "CURSOR",
     /*MSG_INPUT,*/          "INPUT",
-    /*MSG_INPUT_FEEDBACK,*/ "INPUT_FEEDBACK",
+    /*MSG_INPUT_REPLY,*/    "INPUT_REPLY",
+    /*MSG_INPUT_BATCH,*/    "INPUT_BATCH",
+    /*MSG_PAGE,*/           "PAGE",
 
     /*MSG_COMMIT,*/         "COMMIT",
     /*MSG_PREEDIT,*/        "PREEDIT",
     /*MSG_PREEDIT_CLEAR,*/  "PREEDIT_CLEAR",
+    /*MSG_PREEDIT_DELTA,*/  "PREEDIT_DELTA",
+    /*MSG_CANDIDATES,*/     "CANDIDATES",
     /*MSG_FORWARD,*/        "FORWARD",
 
     /*MSG_ACQUIRE_TOKEN,*/  "ACK_TOKEN",
@@ -133,11 +274,15 @@ static size_t g_msgsz[MSG_MAX] = {
     /*MSG_DEL_IC,*/         sizeof(DimeMessageIc),
     /*MSG_CURSOR,*/         sizeof(DimeMessageCursor),
     /*MSG_INPUT,*/          sizeof(DimeMessageInput),
-    /*MSG_INPUT_FEEDBACK,*/ sizeof(DimeMessageInputFeedback),
+    /*MSG_INPUT_REPLY,*/    sizeof(DimeMessageInputReply),
+    /*MSG_INPUT_BATCH,*/    sizeof(DimeMessageInputBatch),
+    /*MSG_PAGE,*/           sizeof(DimeMessagePage),
 
     /*MSG_COMMIT,*/         sizeof(DimeMessageCommit),
     /*MSG_PREEDIT,*/        sizeof(DimeMessagePreedit),
     /*MSG_PREEDIT_CLEAR,*/  sizeof(DimeMessagePreeditClear),
+    /*MSG_PREEDIT_DELTA,*/  sizeof(DimeMessagePreeditDelta),
+    /*MSG_CANDIDATES,*/     sizeof(DimeMessageCandidates),
     /*MSG_FORWARD,*/        sizeof(DimeMessageForward),
 
     /*MSG_ACQUIRE_TOKEN,*/  sizeof(DimeMessageToken),
@@ -148,81 +293,437 @@ static size_t g_msgsz[MSG_MAX] = {
     /*MSG_SHUTDOWN,*/       sizeof(DimeMessageShutdown),
 };
 
+/* posix queues deliver higher priorities first, shm rings and sockets are
+ * fifo. focus and enable go with the keys since they decide where keys go,
+ * text goes with the replies so deltas stay in order. PRIO_LOW is dropped
+ * on a full link on every transport, the rest waits or fails */
+enum {
+    PRIO_TOKEN,
+    PRIO_LOW,
+    PRIO_INPUT,
+};
+
+static int8_t g_msgprio[MSG_MAX] = {
+    /*MSG_INVALID,*/        PRIO_TOKEN,
+    /*MSG_ENABLE,*/         PRIO_INPUT,
+    /*MSG_FOCUS_IN,*/       PRIO_INPUT,
+    /*MSG_FOCUS_OUT,*/      PRIO_INPUT,
+    /*MSG_ADD_IC,*/         PRIO_TOKEN,
+    /*MSG_DEL_IC,*/         PRIO_TOKEN,
+    /*MSG_CURSOR,*/         PRIO_LOW,
+    /*MSG_INPUT,*/          PRIO_INPUT,
+    /*MSG_INPUT_REPLY,*/    PRIO_INPUT,
+    /*MSG_INPUT_BATCH,*/    PRIO_INPUT,
+    /*MSG_PAGE,*/           PRIO_LOW,
+
+    /*MSG_COMMIT,*/         PRIO_INPUT,
+    /*MSG_PREEDIT,*/        PRIO_INPUT,
+    /*MSG_PREEDIT_CLEAR,*/  PRIO_INPUT,
+    /*MSG_PREEDIT_DELTA,*/  PRIO_INPUT,
+    /*MSG_CANDIDATES,*/     PRIO_LOW,
+    /*MSG_FORWARD,*/        PRIO_INPUT,
+
+    /*MSG_ACQUIRE_TOKEN,*/  PRIO_TOKEN,
+    /*MSG_RELEASE_TOKEN,*/  PRIO_TOKEN,
+    /*MSG_CONNECT,*/        PRIO_TOKEN,
+    /*MSG_DISCONNECT,*/     PRIO_TOKEN,
+
+    /*MSG_SHUTDOWN,*/       PRIO_TOKEN,
+};
+
 /* in theory, we can only have one connection per process. */ 
 static DimeConnection *_conn = NULL;
+static GMutex _conn_lock;
+/* the receiving thread, a sync request from a callback must not wait */
+static __thread gboolean _receiving = FALSE;
 
-static int _receive_message(mqd_t mq, char* buf, size_t sz, DimeMessage* msg)
+static void _count_drain(DimeDrainStats* st, int n)
 {
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec++;
-    ssize_t nread = mq_timedreceive(mq, buf, sz, NULL, &timeout);
-    if (nread > 0) {
-        memcpy(msg, buf, g_msgsz[((DimeMessage*)buf)->type]);
-        if (msg->type == MSG_COMMIT) {
-            ((DimeMessageCommit*)msg)->text = (buf + g_msgsz[MSG_COMMIT]);
-
-        } else if (msg->type == MSG_PREEDIT) {
-            ((DimeMessagePreedit*)msg)->text = (buf + g_msgsz[MSG_PREEDIT]);
-        }
-        return 0;
+    st->wakeups++;
+    st->messages += n;
+    if (n > (int)st->max_batch) st->max_batch = n;
+    if (n >= MSG_DRAIN_MAX) st->capped++;
+    st->batches[MIN(n, DIME_DRAIN_HIST - 1)]++;
+}
 
-    } else {
-        dime_warn("mq_receive failed: %s", strerror(errno));
-        return -1;
+static gboolean _valid_message(int8_t type, size_t size)
+{
+    if (size < sizeof(int8_t) * 2 || type <= MSG_INVALID || type >= MSG_MAX ||
+            size < g_msgsz[type]) {
+        dime_warn("drop malformed message (%zu bytes)", size);
+        return FALSE;
     }
+    return TRUE;
 }
 
-static int _send_message(mqd_t mq, DimeMessage* msg, ...)
+/* links are non-blocking, returns 1 if there is nothing to read. text of 
+ * msg points into the link and keeps valid until link->ops->release().
+ * the peer may still write to a shm ring, so the type is read from it once
+ * and everything else is only looked at in the copy */
+static int _receive_message(DimeLink* link, DimeMessage* msg)
 {
-    // assume outband data has been packed along with msg pointer
-    int outband_sz = 0;
-    if (msg->type == MSG_PREEDIT || msg->type == MSG_COMMIT) {
-        va_list(ap);
-        va_start(ap, msg);
-        outband_sz = va_arg(ap, int);
-        va_end(ap);
+    size_t size;
+    const char* buf = link->ops->peek(link, &size);
+    if (!buf) {
+        return 1;
     }
 
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec++;
-    if (mq_timedsend(mq, (char*)msg, g_msgsz[msg->type] + outband_sz, 0, &timeout) < 0) {
-        dime_warn("mq_send failed: %s", strerror(errno));
+    int8_t type = size > 0 ? *(volatile const int8_t*)buf : MSG_INVALID;
+    if (!_valid_message(type, size)) {
+        link->ops->release(link);
         return -1;
-    } 
+    }
+
+    memcpy(msg, buf, g_msgsz[type]);
+    msg->type = type;
+    if (msg->type == MSG_COMMIT) {
+        ((DimeMessageCommit*)msg)->text = (char*)(buf + g_msgsz[MSG_COMMIT]);
+
+    } else if (msg->type == MSG_PREEDIT) {
+        ((DimeMessagePreedit*)msg)->text = (char*)(buf + g_msgsz[MSG_PREEDIT]);
+
+    } else if (msg->type == MSG_PREEDIT_DELTA) {
+        ((DimeMessagePreeditDelta*)msg)->text = (char*)(buf + g_msgsz[MSG_PREEDIT_DELTA]);
+
+    } else if (msg->type == MSG_INPUT_REPLY) {
+        ((DimeMessageInputReply*)msg)->text = (char*)(buf + g_msgsz[MSG_INPUT_REPLY]);
 
+    } else if (msg->type == MSG_CANDIDATES) {
+        ((DimeMessageCandidates*)msg)->text = (char*)(buf + g_msgsz[MSG_CANDIDATES]);
+    }
     return 0;
 }
 
+/* seq numbers wrap around */
+static inline gboolean _seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static int _wait_message(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int n;
+    while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+    return n > 0 ? 0 : -1;
+}
+
+/* counts the result of sending a message of type, ret is what the link 
+ * returned */
+static int _sent(DimeSendStats* st, int8_t type, int ret)
+{
+    if (ret == 0) {
+        st->sent++;
+    } else if (errno == EAGAIN && g_msgprio[type] == PRIO_LOW) {
+        dime_debug("queue full, drop %s", g_msgname[type]);
+        st->dropped++;
+    } else {
+        dime_warn("can not send %s: %s", g_msgname[type], 
+                errno == EAGAIN ? "queue full" : strerror(errno));
+        st->failed++;
+    }
+    return ret;
+}
+
+static int _send_message(DimeLink* link, DimeSendStats* st, DimeMessage* msg)
+{
+    int8_t type = msg->type;
+    return _sent(st, type, link->ops->send(link, (const char*)msg, 
+                g_msgsz[type], g_msgprio[type]));
+}
+
+static int _client_send(DimeConnection* conn, DimeMessage* msg)
+{
+    g_mutex_lock(&conn->send_lock);
+    int ret = _send_message(conn->link, &conn->sent, msg);
+    g_mutex_unlock(&conn->send_lock);
+    return ret;
+}
+
+/* a cursor which finds the queue full is held by c instead of being 
+ * dropped, a newer one replaces it. a NULL cursor retries the held one */
+static int _client_send_cursor(DimeClient* c, const DimeMessageCursor* cursor)
+{
+    DimeConnection* conn = c->conn;
+    int ret = 0;
+
+    g_mutex_lock(&conn->send_lock);
+    if (cursor && c->cursor_held) {
+        // the held one was just retried, there is still no room
+        c->cursor = *cursor;
+        conn->sent.coalesced++;
+    } else {
+        if (cursor) c->cursor = *cursor;
+        ret = conn->link->ops->send(conn->link, (const char*)&c->cursor,
+                g_msgsz[MSG_CURSOR], g_msgprio[MSG_CURSOR]);
+        c->cursor_held = ret < 0 && errno == EAGAIN;
+        if (c->cursor_held) {
+            ret = 0;
+        } else {
+            _sent(&conn->sent, MSG_CURSOR, ret);
+        }
+    }
+    g_mutex_unlock(&conn->send_lock);
+    return ret;
+}
+
+/* call with conn->lock held */
 static DimeClient* _find_client(DimeConnection* conn, uint32_t token)
 {
-    for (GSList *l = _conn->clients; l; l = l->next) {
-        if (((DimeClient*)l->data)->token == token) {
-            return (DimeClient*)l->data;
+    DimeClient* c = (DimeClient*)g_hash_table_lookup(conn->clients, GUINT_TO_POINTER(token));
+    if (!c) {
+        dime_warn("can not find client %u", token);
+    }
+    return c;
+}
+
+/* keeps c->preedit in step with what the server sent, for MSG_PREEDIT, 
+ * MSG_PREEDIT_DELTA, MSG_PREEDIT_CLEAR and MSG_COMMIT. returns FALSE if c 
+ * lost track of it. call with conn->lock held */
+static gboolean _track_preedit(DimeClient* c, int8_t kind, const DimePreeditDelta* delta,
+        const char* text, int text_len)
+{
+    gsize n = text_len > 0 ? text_len - 1 : 0; /* without NUL */
+
+    switch (kind) {
+        case MSG_PREEDIT:
+            g_string_truncate(c->preedit, 0);
+            g_string_append_len(c->preedit, text, n);
+            c->preedit_lost = FALSE;
+            break;
+
+        case MSG_PREEDIT_DELTA:
+            if (c->preedit_lost || delta->offset + delta->del > c->preedit->len ||
+                    c->preedit->len - delta->del + n + 1 != delta->len) {
+                if (!c->preedit_lost) {
+                    dime_warn("client(%d) lost track of preedit", c->token);
+                }
+                c->preedit_lost = TRUE;
+                break;
+            }
+            g_string_erase(c->preedit, delta->offset, delta->del);
+            g_string_insert_len(c->preedit, delta->offset, text, n);
+            break;
+
+        case MSG_PREEDIT_CLEAR:
+        case MSG_COMMIT:
+            // the server starts over from an empty preedit as well
+            g_string_truncate(c->preedit, 0);
+            c->preedit_lost = FALSE;
+            break;
+    }
+    return !c->preedit_lost;
+}
+
+/* MSG_PREEDIT and MSG_PREEDIT_DELTA reach on_preedit as a whole MSG_PREEDIT */
+static void _handle_preedit(DimeMessage* msg)
+{
+    g_rec_mutex_lock(&_conn->lock);
+    DimeClient* c = _find_client(_conn, msg->preedit.token);
+    gboolean ok = FALSE;
+    if (c && msg->type == MSG_PREEDIT) {
+        ok = _track_preedit(c, MSG_PREEDIT, NULL, msg->preedit.text, msg->preedit.text_len);
+    } else if (c) {
+        DimeMessagePreeditDelta* d = &msg->preedit_delta;
+        ok = _track_preedit(c, MSG_PREEDIT_DELTA, &d->delta, d->text, d->text_len);
+    }
+
+    if (ok && c->callbacks && c->callbacks->on_preedit) {
+        DimeMessage m = { .preedit = { .type = MSG_PREEDIT, .flags = msg->flags, 
+            .token = c->token, .text = c->preedit->str, .text_len = c->preedit->len + 1 } };
+        c->callbacks->on_preedit(c, &m);
+    }
+    g_rec_mutex_unlock(&_conn->lock);
+}
+
+static gboolean _valid_candidates(const DimeMessageCandidates* m)
+{
+    if (m->count > DIME_CANDIDATES_MAX || m->n > m->count - m->first ||
+            (m->n > 0 && (m->text_len <= 0 || m->text[m->text_len - 1] != 0))) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < m->n; i++) {
+        if (m->offsets[i] >= m->text_len) return FALSE;
+    }
+    return TRUE;
+}
+
+/* a page in one message is handed over as it is, a fragmented one once 
+ * its last part is there */
+static void _handle_candidates(DimeMessage* msg)
+{
+    DimeMessageCandidates* m = &msg->candidates;
+
+    g_rec_mutex_lock(&_conn->lock);
+    DimeClient* c = _find_client(_conn, m->token);
+    if (!c || !_valid_candidates(m)) {
+        if (c) dime_warn("client(%d) got malformed candidates", c->token);
+        g_rec_mutex_unlock(&_conn->lock);
+        return;
+    }
+
+    // low priority, so it may come after the reply to a later key
+    if (_seq_before(m->seq, c->acked)) {
+        dime_debug("client(%d) drop candidates of %u", c->token, m->seq);
+        g_rec_mutex_unlock(&_conn->lock);
+        return;
+    }
+
+    if (m->first > 0 || m->n < m->count) {
+        if (m->first == 0) {
+            g_string_truncate(c->cands, 0);
+            c->cands_page = m->page;
+            c->cands_got = 0;
+        } else if (c->cands_page != m->page || c->cands_got != m->first) {
+            // a part before it got lost, wait for the next page
+            c->cands_got = -1;
+            g_rec_mutex_unlock(&_conn->lock);
+            return;
+        }
+
+        for (int i = 0; i < m->n; i++) {
+            c->cands_offsets[m->first + i] = c->cands->len;
+            g_string_append(c->cands, m->text + m->offsets[i]);
+            g_string_append_c(c->cands, 0);
+        }
+
+        c->cands_got += m->n;
+        if (c->cands_got < m->count) {
+            g_rec_mutex_unlock(&_conn->lock);
+            return;
+        }
+
+        c->cands_got = -1;
+        m->first = 0;
+        m->n = m->count;
+        memcpy(m->offsets, c->cands_offsets, sizeof m->offsets);
+        m->text = c->cands->str;
+        m->text_len = c->cands->len;
+    }
+
+    if (c->callbacks && c->callbacks->on_candidates) {
+        c->callbacks->on_candidates(c, msg);
+    }
+    g_rec_mutex_unlock(&_conn->lock);
+}
+
+/* the candidates behind the text of a reply as a MSG_CANDIDATES of its own */
+static gboolean _unpack_page(const DimeMessageInputReply* reply, DimeMessage* msg)
+{
+    DimeMessageCandidates* m = &msg->candidates;
+    *m = (DimeMessageCandidates) {
+        .type = MSG_CANDIDATES,
+        .token = reply->token,
+        .seq = reply->seq,
+        .page_count = reply->page_count,
+        .count = reply->count,
+        .n = reply->count,
+        .text = reply->text + reply->text_len,
+        .text_len = reply->cands_len,
+    };
+    if (m->n > DIME_CANDIDATES_MAX) return FALSE;
+
+    int used = 0;
+    for (int i = 0; i < m->n; i++) {
+        if (used >= m->text_len) return FALSE;
+        m->offsets[i] = used;
+        used += strnlen(m->text + used, m->text_len - used) + 1;
+    }
+    return TRUE;
+}
+
+static void _handle_input_reply(DimeMessage* msg)
+{
+    DimeMessageInputReply* reply = &msg->input_reply;
+
+    g_rec_mutex_lock(&_conn->lock);
+    DimeClient* c = _find_client(_conn, reply->token);
+    if (!c) {
+        g_rec_mutex_unlock(&_conn->lock);
+        return;
+    }
+
+    dime_debug("client %d acked %u", c->token, reply->seq);
+    if (_seq_before(c->acked, reply->seq)) {
+        g_atomic_int_set(&c->acked, reply->seq);
+    }
+
+    DimeMessage page = { .type = MSG_INVALID };
+    if (reply->has_page && !_unpack_page(reply, &page)) {
+        dime_warn("client(%d) got malformed candidates", c->token);
+        page.type = MSG_INVALID;
+    }
+
+    if (reply->kind != MSG_INVALID) {
+        gboolean ok = _track_preedit(c, reply->kind, &reply->delta, reply->text, reply->text_len);
+        if (!ok) {
+            reply->kind = MSG_INVALID; // the keys are still acked
+            reply->text = NULL;
+            reply->text_len = 0;
+        } else if (reply->kind == MSG_PREEDIT_DELTA) {
+            reply->kind = MSG_PREEDIT;
+            reply->text = c->preedit->str;
+            reply->text_len = c->preedit->len + 1;
         }
     }
 
-    dime_warn("can not find client %u", token);
-    return NULL;
+    DimeMessageCallbacks* cbs = c->callbacks;
+    if (cbs && cbs->on_input_reply) {
+        cbs->on_input_reply(c, msg);
+
+    } else if (cbs && reply->kind == MSG_PREEDIT && cbs->on_preedit) {
+        DimeMessage m = { .preedit = { .type = MSG_PREEDIT, .token = reply->token, 
+            .text = reply->text, .text_len = reply->text_len } };
+        cbs->on_preedit(c, &m);
+
+    } else if (cbs && reply->kind == MSG_COMMIT && cbs->on_commit) {
+        DimeMessage m = { .commit = { .type = MSG_COMMIT, .token = reply->token, 
+            .text = reply->text, .text_len = reply->text_len } };
+        cbs->on_commit(c, &m);
+    }
+
+    if (page.type == MSG_CANDIDATES) _handle_candidates(&page);
+    g_rec_mutex_unlock(&_conn->lock);
 }
 
 #define _handle_client_message(token, msg, cb) do {     \
+    g_rec_mutex_lock(&_conn->lock);                     \
     DimeClient* c = _find_client(_conn, token);         \
     dime_debug("get %s client %d", g_msgname[msg.type], token); \
+    if (c) _track_preedit(c, msg.type, NULL, NULL, 0);  \
     if (c && c->callbacks && c->callbacks->cb)          \
         c->callbacks->cb(c, &msg);       \
+    g_rec_mutex_unlock(&_conn->lock);                   \
 } while (0)
 
-static int client_dispatch_message()
+/* a sync request other than keys comes back once the server handled it */
+static void _handle_sync_ack(DimeMessage* msg)
 {
-    DimeMessage msg;
+    g_rec_mutex_lock(&_conn->lock);
+    DimeClient* c = _find_client(_conn, msg->focus.token);
+    if (c) g_atomic_int_inc(&c->synced);
+    g_rec_mutex_unlock(&_conn->lock);
+}
 
-    int ret = 0;
-    if ((ret = _receive_message(_conn->mq_msg, _conn->msgbuf, _conn->msgsize, &msg)) < 0) {
-        return ret;
-    }
+static void _forget_token(gpointer key, gpointer value, gpointer user_data)
+{
+    ((DimeClient*)value)->token = 0;
+}
+
+/* tokens died with the server, clients drop what they send */
+static void _server_gone()
+{
+    g_rec_mutex_lock(&_conn->lock);
+    g_hash_table_foreach(_conn->clients, _forget_token, NULL);
+    g_hash_table_remove_all(_conn->clients);
+    g_rec_mutex_unlock(&_conn->lock);
+    _conn->state = CONN_INITIALIZED;
+}
 
+static void client_handle_message(DimeMessage msg)
+{
     /*dime_debug("get %s", g_msgname[msg.type]);*/
 
     switch(msg.type) {
@@ -234,10 +735,16 @@ static int client_dispatch_message()
             break;
 
         case MSG_ACQUIRE_TOKEN: {
+            // outband is only trusted if it is a client still waiting
             DimeClient* c = (DimeClient*)msg.token.outband;
-            g_assert(c->magic == CLIENT_MAGIC);
-            c->token = msg.token.token;
-            dime_info("acquired token %d", c->token);
+            g_rec_mutex_lock(&_conn->lock);
+            if (g_hash_table_remove(_conn->pending, c)) {
+                g_assert(c->magic == CLIENT_MAGIC);
+                c->token = msg.token.token;
+                g_hash_table_insert(_conn->clients, GUINT_TO_POINTER(c->token), c);
+                dime_info("acquired token %d", c->token);
+            }
+            g_rec_mutex_unlock(&_conn->lock);
             break;
         }
 
@@ -245,10 +752,20 @@ static int client_dispatch_message()
             _handle_client_message(msg.commit.token, msg, on_commit);
             break;
         case MSG_ENABLE: 
-            _handle_client_message(msg.enable.token, msg, on_enable);
+            if (msg.flags & DIME_MSG_FLAG_SYNC) {
+                _handle_sync_ack(&msg);
+            } else {
+                _handle_client_message(msg.enable.token, msg, on_enable);
+            }
+            break;
+        case MSG_FOCUS_IN:
+        case MSG_FOCUS_OUT:
+        case MSG_PAGE:
+            _handle_sync_ack(&msg);
             break;
         case MSG_PREEDIT:
-            _handle_client_message(msg.preedit.token, msg, on_preedit);
+        case MSG_PREEDIT_DELTA:
+            _handle_preedit(&msg);
             break;
         case MSG_PREEDIT_CLEAR:
             _handle_client_message(msg.preedit_clear.token, msg, on_preedit_clear);
@@ -257,26 +774,106 @@ static int client_dispatch_message()
             _handle_client_message(msg.forward.token, msg, on_forward);
             break;
 
-        case MSG_INPUT_FEEDBACK:
+        case MSG_INPUT_REPLY:
+            _handle_input_reply(&msg);
+            break;
+
+        case MSG_CANDIDATES:
+            _handle_candidates(&msg);
+            break;
+
+        case MSG_SHUTDOWN:
+            dime_info("server shut down");
+            _server_gone();
             break;
 
         default: 
             g_assert_not_reached();
             break;
     }
-    
-    return ret;
+}
+
+/* handles whatever is queued, up to MSG_DRAIN_MAX messages. call with
+ * recv_lock held */
+static int client_dispatch_messages()
+{
+    DimeMessage msg;
+
+    DimeLink* link = _conn->link;
+    int n = 0, ret = 0;
+
+    _receiving = TRUE;
+    while (n < MSG_DRAIN_MAX && (ret = _receive_message(link, &msg)) <= 0) {
+        if (ret == 0) {
+            client_handle_message(msg);
+            link->ops->release(link);
+        }
+        n++;
+    }
+    _receiving = FALSE;
+
+    if (n == MSG_DRAIN_MAX) link->ops->defer(link);
+    _count_drain(&_conn->stats, n);
+    return n;
+}
+
+/* the server went away without MSG_SHUTDOWN. what it sent before is 
+ * still handled */
+static gboolean _client_hang_up()
+{
+    dime_info("server hung up");
+    g_mutex_lock(&_conn->recv_lock);
+    while (client_dispatch_messages() == MSG_DRAIN_MAX) ;
+    g_mutex_unlock(&_conn->recv_lock);
+
+    _server_gone();
+    return FALSE;
 }
 
 static gboolean client_dispatch_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
 {
-    if (condition != G_IO_IN)
-        return FALSE;
+    if (condition & (G_IO_HUP | G_IO_ERR)) {
+        _conn->watch_id = 0;
+        return _client_hang_up();
+    }
 
-    client_dispatch_message();
+    g_mutex_lock(&_conn->recv_lock);
+    client_dispatch_messages();
+    g_mutex_unlock(&_conn->recv_lock);
     return TRUE;
 }
 
+/* shm links: the handoff socket stays open as long as the server does */
+static gboolean client_hup_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    _conn->sock_watch_id = 0;
+    return _client_hang_up();
+}
+
+/* waits until acked, a counter of the client set by the receiving thread,
+ * gets to mark. the reply may be handled by this thread or the receiving
+ * one */
+static int _wait_reply(DimeConnection* conn, uint32_t* acked, uint32_t mark)
+{
+    gint64 deadline = g_get_monotonic_time() + MSG_SYNC_TIMEOUT * 1000;
+    while (_seq_before(g_atomic_int_get(acked), mark)) {
+        if (g_mutex_trylock(&conn->recv_lock)) {
+            int n = client_dispatch_messages();
+            g_mutex_unlock(&conn->recv_lock);
+            if (n > 0) continue;
+        }
+
+        // another thread may be receiving, so wake up now and then to see
+        // if it handled the reply
+        int left = (deadline - g_get_monotonic_time()) / 1000;
+        if (left <= 0) {
+            return -ERR_TIMEOUT;
+        }
+        _wait_message(conn->link->fd, MIN(left, 10));
+    }
+    return 0;
+}
+
 #undef _handle_client_message
 
 static int dime_mq_build_connect(DimeConnection* c)
@@ -287,7 +884,7 @@ static int dime_mq_build_connect(DimeConnection* c)
     if (c->state == CONN_INITIALIZED) {
         msg_conn.type = MSG_CONNECT;
         msg_conn.id  = c->id;
-        _send_message(c->mq_srv, (DimeMessage*)&msg_conn);
+        _client_send(c, (DimeMessage*)&msg_conn);
 
         c->state = CONN_HANDSHAKE;
     }
@@ -295,79 +892,165 @@ static int dime_mq_build_connect(DimeConnection* c)
     return 0;
 }
 
-//TODO: should allow dangling clients and reconnect when server gets back online.
-int dime_mq_connect()
+static int _connect_mq(DimeConnection* c, const char* disp)
 {
-    if (_conn) {
-        dime_warn("connection already exists!");
-        return 0;
-    }
-
-    DimeConnection* c = (DimeConnection*)calloc(1, sizeof(DimeConnection));
-    c->id = getpid();
-    c->state = CONN_INITIALIZED;
-
-    char *disp = getenv("DISPLAY");
-    snprintf(c->mq_name, NAME_MAX, DIME_SERVER_MQ_NAME_TMPL, disp);
-    dime_info("connect to %s", c->mq_name);
-
     struct mq_attr attr = {
         .mq_curmsgs = 0,
         .mq_flags = 0,
         .mq_msgsize = MSG_BUF_SIZE,
         .mq_maxmsg = MSG_MAX_NR,
     };
-    c->mq_srv = mq_open(c->mq_name, O_CREAT|O_WRONLY, 0664, &attr);
-    if (c->mq_srv < 0) {
+    mqd_t mq_srv = mq_open(c->mq_name, O_CREAT|O_WRONLY|O_NONBLOCK, 0664, &attr);
+    if (mq_srv < 0) {
         dime_warn("connect failed: %d: %s", errno, strerror(errno));
-        goto _error;
+        return -1;
     }
 
-    mq_getattr(c->mq_srv, &attr);
+    mq_getattr(mq_srv, &attr);
     g_assert(attr.mq_msgsize == MSG_BUF_SIZE);
     dime_debug("attr.mq_maxmsg = %d", attr.mq_maxmsg);
     g_assert(attr.mq_maxmsg == MSG_MAX_NR);
-    c->msgsize = attr.mq_msgsize;
-    c->msgbuf = (char*)malloc(c->msgsize);
 
     attr.mq_flags = 0;
     attr.mq_curmsgs = 0;
 
     snprintf(c->mq_msg_name, NAME_MAX, DIME_CONNECTION_MQ_NAME_TMPL, disp, c->id);
     dime_debug("build connection [%s]", c->mq_msg_name);
-    c->mq_msg = mq_open(c->mq_msg_name, O_CREAT|O_RDONLY, 0664, &attr);
-    if (c->mq_msg < 0) {
+    mqd_t mq_msg = mq_open(c->mq_msg_name, O_CREAT|O_RDONLY|O_NONBLOCK, 0664, &attr);
+    if (mq_msg < 0) {
         dime_warn("mq_open failed: %d: %s", errno, strerror(errno));
-        goto _error;
+        mq_close(mq_srv);
+        return -1;
+    }
+
+    c->link = dime_link_mq_new(mq_srv, mq_msg, attr.mq_msgsize);
+    return 0;
+}
+
+/* hands a shared region over to the server, which answers MSG_CONNECT 
+ * through it, so the handshake is already on its way */
+static int _connect_shm(DimeConnection* c)
+{
+    int fds[3];
+    DimeLink* link = dime_link_shm_new(MSG_BUF_SIZE, fds);
+    if (!link) {
+        return -1;
+    }
+
+    DimeMessageConnect msg_conn = { .type = MSG_CONNECT, .id = c->id };
+    c->sock = dime_link_connect(c->mq_name, &msg_conn, sizeof msg_conn, fds, 3);
+    for (int i = 0; i < 3; i++) close(fds[i]);
+
+    if (c->sock < 0) {
+        link->ops->free(link);
+        return -1;
+    }
+
+    c->link = link;
+    c->state = CONN_HANDSHAKE;
+    return 0;
+}
+
+static int _connect_sock(DimeConnection* c)
+{
+    DimeMessageConnect msg_conn = { .type = MSG_CONNECT, .id = c->id };
+    int fd = dime_link_connect(c->mq_name, &msg_conn, sizeof msg_conn, NULL, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    c->link = dime_link_sock_new(fd, MSG_BUF_SIZE);
+    c->state = CONN_HANDSHAKE;
+    return 0;
+}
+
+//TODO: should allow dangling clients and reconnect when server gets back online.
+int dime_mq_connect()
+{
+    g_mutex_lock(&_conn_lock);
+    if (_conn) {
+        g_mutex_unlock(&_conn_lock);
+        dime_debug("connection already exists!");
+        return 0;
+    }
+
+    DimeConnection* c = (DimeConnection*)calloc(1, sizeof(DimeConnection));
+    c->id = getpid();
+    c->state = CONN_INITIALIZED;
+    c->sock = -1;
+
+    char *disp = getenv("DISPLAY");
+    snprintf(c->mq_name, NAME_MAX, DIME_SERVER_MQ_NAME_TMPL, disp);
+    dime_info("connect to %s", c->mq_name);
+
+    const char* transport = getenv(DIME_TRANSPORT_ENV);
+    gboolean any = !transport || !*transport;
+    int ret = -1;
+    if (ret < 0 && (any || strcmp(transport, "shm") == 0)) ret = _connect_shm(c);
+    if (ret < 0 && (any || strcmp(transport, "sock") == 0)) ret = _connect_sock(c);
+    if (ret < 0 && (any || strcmp(transport, "mq") == 0)) ret = _connect_mq(c, disp);
+    if (ret < 0) {
+        free(c);
+        g_mutex_unlock(&_conn_lock);
+        return -1;
     }
+    dime_info("transport %s", c->link->ops->name);
+
+    g_mutex_init(&c->send_lock);
+    g_mutex_init(&c->recv_lock);
+    g_rec_mutex_init(&c->lock);
+    c->clients = g_hash_table_new(g_direct_hash, g_direct_equal);
+    c->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-    c->ch = g_io_channel_unix_new(c->mq_msg);
+    c->ch = g_io_channel_unix_new(c->link->fd);
     g_io_channel_set_encoding(c->ch, NULL, NULL);
     g_io_channel_set_buffered(c->ch, FALSE);
-    c->watch_id = g_io_add_watch(c->ch, G_IO_IN, client_dispatch_callback, c);
+    c->watch_id = g_io_add_watch(c->ch, G_IO_IN | G_IO_HUP | G_IO_ERR, 
+            client_dispatch_callback, c);
+    if (c->sock >= 0) {
+        c->sock_ch = g_io_channel_unix_new(c->sock);
+        c->sock_watch_id = g_io_add_watch(c->sock_ch, G_IO_HUP | G_IO_ERR, 
+                client_hup_callback, c);
+    }
 
     _conn = c;
     dime_mq_build_connect(c);
+    g_mutex_unlock(&_conn_lock);
     dime_debug("new connection");
     return 0;
-
-_error:
-    free(c->msgbuf);
-    if (c->ch) g_io_channel_unref(c->ch);
-    free(c);
-    return -1;
 }
 
 int dime_mq_disconnect()
 {
-    if (!_conn) {
+    g_mutex_lock(&_conn_lock);
+    DimeConnection* c = _conn;
+    _conn = NULL;
+    g_mutex_unlock(&_conn_lock);
+    if (!c) {
         return 0;
     }
 
-    dime_debug("disconnection %s", _conn->mq_name);
-    free(_conn->msgbuf);
-    free(_conn);
-    _conn = NULL;
+    dime_debug("disconnection %s", c->mq_name);
+    if (c->state == CONN_ESTABLISHED) {
+        DimeMessageDisconnect msg = { .type = MSG_DISCONNECT, .id = c->id };
+        _client_send(c, (DimeMessage*)&msg);
+    }
+    // the server has opened it by now or never will
+    if (c->mq_msg_name[0]) mq_unlink(c->mq_msg_name);
+
+    if (c->watch_id) g_source_remove(c->watch_id);
+    g_io_channel_unref(c->ch);
+    if (c->sock_watch_id) g_source_remove(c->sock_watch_id);
+    if (c->sock_ch) g_io_channel_unref(c->sock_ch);
+    c->link->ops->free(c->link);
+    if (c->sock >= 0) close(c->sock);
+
+    g_hash_table_destroy(c->clients);
+    g_hash_table_destroy(c->pending);
+    g_rec_mutex_clear(&c->lock);
+    g_mutex_clear(&c->recv_lock);
+    g_mutex_clear(&c->send_lock);
+    free(c);
     return 0;
 }
 
@@ -380,13 +1063,19 @@ DimeClient* dime_mq_acquire_token()
     DimeClient* c = (DimeClient*)calloc(1, sizeof(DimeClient));
     c->magic = CLIENT_MAGIC;
     c->conn = _conn;
-    _conn->clients = g_slist_prepend(_conn->clients, c);
+    c->preedit = g_string_new("");
+    c->cands = g_string_new("");
+    c->cands_got = -1;
+
+    g_rec_mutex_lock(&c->conn->lock);
+    g_hash_table_add(c->conn->pending, c);
+    g_rec_mutex_unlock(&c->conn->lock);
 
     DimeMessageToken msg_token;
     msg_token.type = MSG_ACQUIRE_TOKEN;
-    msg_token.id = _conn->id;
+    msg_token.id = c->conn->id;
     msg_token.outband = (uintptr_t)c;
-    _send_message(_conn->mq_srv, (DimeMessage*)&msg_token);
+    _client_send(c->conn, (DimeMessage*)&msg_token);
 
     dime_debug("");
     return c;
@@ -397,13 +1086,21 @@ int dime_mq_release_token(DimeClient* c)
     if (c->conn->state != CONN_ESTABLISHED || c->token == 0)
         return -1;
 
+    // waits for callbacks of c running on the receiving thread
+    g_rec_mutex_lock(&c->conn->lock);
+    g_hash_table_remove(c->conn->clients, GUINT_TO_POINTER(c->token));
+    g_rec_mutex_unlock(&c->conn->lock);
+
     DimeMessageToken msg_token;
     msg_token.type = MSG_RELEASE_TOKEN;
     msg_token.token = c->token;
     msg_token.id = c->conn->id;
-    _send_message(c->conn->mq_srv, (DimeMessage*)&msg_token);
+    _client_send(c->conn, (DimeMessage*)&msg_token);
 
     dime_info("release token %d", c->token);
+    g_string_free(c->preedit, TRUE);
+    g_string_free(c->cands, TRUE);
+    free(c->callbacks);
     free(c);
 
     return 0;
@@ -446,14 +1143,51 @@ int dime_mq_client_key_async(DimeClient* c, int key, uint32_t time)
     return dime_mq_client_send(c, 0, MSG_INPUT, key, time);
 }
 
-int dime_mq_client_send(DimeClient* c, int8_t flag, int8_t type, ...)
+uint32_t dime_mq_client_pending(DimeClient* c)
 {
-    if (c->conn->state != CONN_ESTABLISHED || c->token == 0) {
-        dime_debug("no connection or invalid client, drop request");
-        return -1;
-    }
+    return c->seq - g_atomic_int_get(&c->acked);
+}
 
-    dime_debug("client(%d) send(%d, %s)%s", c->token, type, g_msgname[type],
+int dime_mq_client_page(DimeClient* c, int page)
+{
+    return dime_mq_client_send(c, 0, MSG_PAGE, page);
+}
+
+const char* dime_mq_candidate(const DimeMessageCandidates* m, int i)
+{
+    g_return_val_if_fail(i >= 0 && i < m->n, NULL);
+    return m->text + m->offsets[i];
+}
+
+int dime_mq_client_keys(DimeClient* c, const int32_t* keys, int n, uint32_t time)
+{
+    for (int i = 0; i < n; i += DIME_INPUT_BATCH_MAX) {
+        int ret = dime_mq_client_send(c, 0, MSG_INPUT_BATCH, keys + i,
+                MIN(n - i, DIME_INPUT_BATCH_MAX), time);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+int dime_mq_client_wait(DimeClient* c)
+{
+    if (dime_mq_client_pending(c) == 0 || _receiving) return 0;
+
+    if (_wait_reply(c->conn, &c->acked, c->seq) < 0) {
+        dime_warn("client(%d) has %u keys unanswered", c->token, dime_mq_client_pending(c));
+        return -ERR_TIMEOUT;
+    }
+    return 0;
+}
+
+int dime_mq_client_send(DimeClient* c, int8_t flag, int8_t type, ...)
+{
+    if (c->conn->state != CONN_ESTABLISHED || c->token == 0) {
+        dime_debug("no connection or invalid client, drop request");
+        return -1;
+    }
+
+    dime_debug("client(%d) send(%d, %s)%s", c->token, type, g_msgname[type],
             (flag & DIME_MSG_FLAG_SYNC ? " SYNC":""));
 
     va_list ap;
@@ -480,39 +1214,426 @@ int dime_mq_client_send(DimeClient* c, int8_t flag, int8_t type, ...)
 
         case MSG_ADD_IC:
         case MSG_DEL_IC:
+            break;
+
         case MSG_CURSOR:
+            msg.cursor.token = c->token;
+            msg.cursor.x = va_arg(ap, int);
+            msg.cursor.y = va_arg(ap, int);
+            msg.cursor.w = va_arg(ap, int);
+            msg.cursor.h = va_arg(ap, int);
             break;
 
         case MSG_INPUT:
             msg.input.token = c->token;
+            msg.input.seq = ++c->seq;
             msg.input.key = va_arg(ap, int32_t);
             msg.input.time = va_arg(ap, uint32_t);
             break;
 
+        case MSG_PAGE:
+            msg.page.token = c->token;
+            msg.page.page = va_arg(ap, int);
+            break;
+
+        case MSG_INPUT_BATCH: {
+            const int32_t* keys = va_arg(ap, const int32_t*);
+            int n = va_arg(ap, int);
+            g_assert(n > 0 && n <= DIME_INPUT_BATCH_MAX);
+            msg.input_batch.token = c->token;
+            msg.input_batch.seq = c->seq += n;
+            msg.input_batch.count = n;
+            memcpy(msg.input_batch.keys, keys, n * sizeof(int32_t));
+            msg.input_batch.time = va_arg(ap, uint32_t);
+            break;
+        }
+
         default: g_assert_not_reached(); break;
     }
     va_end(ap);
 
     g_assert (msg.type > MSG_INVALID && msg.type <= MSG_MAX);
-    _send_message(c->conn->mq_srv, &msg);
 
-    if (flag & DIME_MSG_FLAG_SYNC) {
-        return client_dispatch_message();
+    if (c->cursor_held) {
+        _client_send_cursor(c, NULL);
+    }
+    if (type == MSG_CURSOR) {
+        return _client_send_cursor(c, &msg.cursor);
+    }
+
+    // keys are answered by their replies, anything else by its echo
+    gboolean keys = type == MSG_INPUT || type == MSG_INPUT_BATCH;
+    if ((flag & DIME_MSG_FLAG_SYNC) && !keys) {
+        c->syncs++;
+    }
+    if (_client_send(c->conn, &msg) < 0) {
+        // what never left is not waited for, and keys leave no gap in seq
+        if (type == MSG_INPUT) {
+            c->seq--;
+        } else if (type == MSG_INPUT_BATCH) {
+            c->seq -= msg.input_batch.count;
+        } else if (flag & DIME_MSG_FLAG_SYNC) {
+            c->syncs--;
+        }
+        return -1;
+    }
+
+    // from a callback the reply can only come after it returns
+    if ((flag & DIME_MSG_FLAG_SYNC) && !_receiving) {
+        int ret;
+        if (keys) {
+            ret = _wait_reply(c->conn, &c->acked, c->seq);
+        } else {
+            ret = _wait_reply(c->conn, &c->synced, c->syncs);
+        }
+        if (ret < 0) {
+            dime_warn("no reply for %s from server", g_msgname[type]);
+            return -ERR_TIMEOUT;
+        }
     }
     return 0;
 }
 
+void dime_mq_client_stats(DimeDrainStats* st)
+{
+    if (_conn) {
+        *st = _conn->stats;
+    } else {
+        memset(st, 0, sizeof *st);
+    }
+}
+
+void dime_mq_client_send_stats(DimeSendStats* st)
+{
+    memset(st, 0, sizeof *st);
+    if (_conn && _conn->link) {
+        g_mutex_lock(&_conn->send_lock);
+        *st = _conn->sent;
+        st->queued = _conn->link->ops->queued(_conn->link);
+        g_mutex_unlock(&_conn->send_lock);
+    }
+}
+
 int dime_mq_client_set_receive_callbacks(DimeClient* c, DimeMessageCallbacks cbs)
 {
+    g_rec_mutex_lock(&c->conn->lock);
     if (!c->callbacks) {
         c->callbacks = (DimeMessageCallbacks*)calloc(1, sizeof(DimeMessageCallbacks));
     }
     memcpy(c->callbacks, &cbs, sizeof cbs);
+    g_rec_mutex_unlock(&c->conn->lock);
     return 0;
 }
 
 /*----------------------------------------------------------------------*/
 
+/* NULL unless token is in use */
+static DimeTokenSlot* _token_slot(DimeServer* s, uint32_t token)
+{
+    uint32_t i = token & (TOKEN_SLOT_MAX - 1);
+    if (i >= s->nslots) return NULL;
+
+    DimeTokenSlot* slot = &s->slots[i];
+    if (!slot->used || slot->generation != token >> TOKEN_SLOT_BITS) return NULL;
+    return slot;
+}
+
+static uint32_t _slot_token(DimeServer* s, DimeTokenSlot* slot)
+{
+    return (uint32_t)slot->generation << TOKEN_SLOT_BITS | (uint32_t)(slot - s->slots);
+}
+
+/* 0 if all TOKEN_SLOT_MAX are taken */
+static uint32_t _alloc_token(DimeServer* s, struct _DimeServerConnection* conn)
+{
+    uint32_t i = s->free_slot;
+    if (i != TOKEN_NO_SLOT) {
+        s->free_slot = s->slots[i].next_free;
+    } else {
+        if (s->nslots == TOKEN_SLOT_MAX) return 0;
+        if (s->nslots == s->slots_cap) {
+            s->slots_cap = s->slots_cap ? s->slots_cap * 2 : 64;
+            s->slots = (DimeTokenSlot*)realloc(s->slots, s->slots_cap * sizeof(DimeTokenSlot));
+        }
+        i = s->nslots++;
+        memset(&s->slots[i], 0, sizeof(DimeTokenSlot));
+    }
+
+    DimeTokenSlot* slot = &s->slots[i];
+    slot->generation = slot->generation % TOKEN_GEN_MAX + 1;
+    slot->used = TRUE;
+    slot->conn = conn;
+    return _slot_token(s, slot);
+}
+
+static void _free_token(DimeServer* s, DimeTokenSlot* slot)
+{
+    uint32_t token = _slot_token(s, slot);
+    if (s->active.token == token) s->active.token = 0;
+    if (s->batch.token == token) s->batch.count = 0;
+
+    if (s->callbacks && s->callbacks->on_release) {
+        DimeMessageToken m = { .type = MSG_RELEASE_TOKEN, .id = slot->conn->id, .token = token };
+        s->callbacks->on_release(s, (DimeMessage*)&m);
+    }
+
+    if (slot->preedit.text) g_string_free(slot->preedit.text, TRUE);
+    memset(&slot->preedit, 0, sizeof slot->preedit);
+    slot->used = FALSE;
+    slot->conn = NULL;
+    slot->next_free = s->free_slot;
+    s->free_slot = slot - s->slots;
+}
+
+static DimePreeditState* _preedit_state(DimeServer* s, uint32_t token)
+{
+    DimeTokenSlot* slot = _token_slot(s, token);
+    return slot ? &slot->preedit : NULL;
+}
+
+static GIOChannel* _watch(int fd, GIOCondition cond, GIOFunc func, gpointer data, guint* id)
+{
+    GIOChannel* ch = g_io_channel_unix_new(fd);
+    g_io_channel_set_encoding(ch, NULL, NULL);
+    g_io_channel_set_buffered(ch, FALSE);
+    *id = g_io_add_watch(ch, cond, func, data);
+    return ch;
+}
+
+static void _free_connection(gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+
+    if (conn->server->current == conn) conn->server->current = NULL;
+    if (conn->watch_id) g_source_remove(conn->watch_id);
+    if (conn->ch) g_io_channel_unref(conn->ch);
+    if (conn->sock_watch_id) g_source_remove(conn->sock_watch_id);
+    if (conn->sock_ch) g_io_channel_unref(conn->sock_ch);
+    if (conn->sock >= 0) close(conn->sock);
+    if (conn->out_watch_id) g_source_remove(conn->out_watch_id);
+    if (conn->out_ch) g_io_channel_unref(conn->out_ch);
+    if (conn->drop_id) g_source_remove(conn->drop_id);
+    if (conn->pid_watch_id) g_source_remove(conn->pid_watch_id);
+    if (conn->pid_ch) g_io_channel_unref(conn->pid_ch);
+    if (conn->pidfd >= 0) close(conn->pidfd);
+    g_free(conn->mq_name);
+
+    gpointer item;
+    while ((item = g_queue_pop_head(&conn->backlog))) free(item);
+    free(conn->scratch);
+
+    if (conn->link) conn->link->ops->free(conn->link);
+    free(conn);
+}
+
+static DimeServerConnection* _new_connection(DimeServer* s, int id, DimeLink* link)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)calloc(1, sizeof(DimeServerConnection));
+    conn->id = id;
+    conn->server = s;
+    conn->link = link;
+    conn->sock = -1;
+    conn->pidfd = -1;
+    g_queue_init(&conn->backlog);
+    conn->scratch = (char*)malloc(MSG_BUF_SIZE);
+    return conn;
+}
+
+/* replaces an earlier connection of the same id, its tokens move over */
+static void _add_connection(DimeServer* s, DimeServerConnection* conn)
+{
+    DimeServerConnection* old = (DimeServerConnection*)g_hash_table_lookup(
+            s->connections, GINT_TO_POINTER(conn->id));
+    for (uint32_t i = 0; old && i < s->nslots; i++) {
+        if (s->slots[i].conn == old) s->slots[i].conn = conn;
+    }
+    g_hash_table_replace(s->connections, GINT_TO_POINTER(conn->id), conn);
+}
+
+static DimeServerConnection* _find_connection(DimeServer* s, uint32_t token)
+{
+    DimeTokenSlot* slot = _token_slot(s, token);
+    if (!slot) {
+        dime_warn("no connection for token %u", token);
+        return NULL;
+    }
+    return slot->conn;
+}
+
+/* forgets a client process: its tokens and the connection itself */
+static void _reap_connection(DimeServerConnection* conn)
+{
+    DimeServer* s = conn->server;
+
+    int n = 0;
+    for (uint32_t i = 0; i < s->nslots; i++) {
+        if (s->slots[i].used && s->slots[i].conn == conn) {
+            _free_token(s, &s->slots[i]);
+            n++;
+        }
+    }
+    dime_info("reap connection %d, %d tokens", conn->id, n);
+
+    g_hash_table_remove(s->connections, GINT_TO_POINTER(conn->id));
+}
+
+static gboolean _drop_connection(gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+    conn->drop_id = 0;
+    _reap_connection(conn);
+    return FALSE;
+}
+
+/* reaps conn once whatever is using it now is done with it */
+static void _drop_later(DimeServerConnection* conn)
+{
+    if (!conn->drop_id) {
+        conn->drop_id = g_idle_add(_drop_connection, conn);
+    }
+}
+
+/* sends what the backlog holds until the link is full again, returns how 
+ * many messages are left */
+static guint _flush_backlog(DimeServerConnection* conn)
+{
+    DimeLink* link = conn->link;
+    DimeBacklogItem* item;
+    while ((item = (DimeBacklogItem*)g_queue_peek_head(&conn->backlog))) {
+        int8_t type = ((DimeMessage*)item->buf)->type;
+        int ret = link->ops->send(link, item->buf, item->size, g_msgprio[type]);
+        if (ret < 0 && errno == EAGAIN) break;
+
+        _sent(&conn->server->sent, type, ret);
+        free(g_queue_pop_head(&conn->backlog));
+    }
+    return g_queue_get_length(&conn->backlog);
+}
+
+static gboolean backlog_callback(gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+    if (_flush_backlog(conn) > 0) return TRUE;
+
+    conn->out_watch_id = 0; /* removed as we return FALSE */
+    if (conn->out_ch) {
+        g_io_channel_unref(conn->out_ch);
+        conn->out_ch = NULL;
+    }
+    return FALSE;
+}
+
+static gboolean writable_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    return backlog_callback(data);
+}
+
+/* keeps a message the link has no room for, in order behind the others */
+static int _backlog(DimeServerConnection* conn, const char* buf, size_t size)
+{
+    DimeServer* s = conn->server;
+
+    if (conn->drop_id) {
+        s->sent.failed++;
+        return -1;
+    }
+
+    if (g_queue_get_length(&conn->backlog) >= BACKLOG_MAX) {
+        // never let one hung client hold messages meant for the others
+        dime_warn("connection %d stopped reading, drop it", conn->id);
+        s->sent.failed++;
+        s->sent.hung++;
+        _drop_later(conn);
+        return -1;
+    }
+
+    DimeBacklogItem* item = (DimeBacklogItem*)malloc(sizeof(DimeBacklogItem) + size);
+    item->size = size;
+    memcpy(item->buf, buf, size);
+    g_queue_push_tail(&conn->backlog, item);
+    s->sent.backlogged++;
+
+    if (!conn->out_watch_id) {
+        int fd = conn->link->ops->tx_fd(conn->link);
+        if (fd >= 0) {
+            conn->out_ch = _watch(fd, G_IO_OUT, writable_callback, conn, &conn->out_watch_id);
+        } else {
+            conn->out_watch_id = g_timeout_add(BACKLOG_RETRY, backlog_callback, conn);
+        }
+    }
+    return 0;
+}
+
+/* counts what the link returned for buf, a full link backlogs it unless 
+ * it may be dropped */
+static int _conn_sent(DimeServerConnection* conn, const char* buf, size_t size, int ret)
+{
+    int8_t type = ((const DimeMessage*)buf)->type;
+    if (ret < 0 && errno == EAGAIN && g_msgprio[type] != PRIO_LOW) {
+        return _backlog(conn, buf, size);
+    }
+    return _sent(&conn->server->sent, type, ret);
+}
+
+static int _conn_send(DimeServerConnection* conn, const char* buf, size_t size)
+{
+    // nothing overtakes the backlog
+    int ret = -1;
+    errno = EAGAIN;
+    if (g_queue_is_empty(&conn->backlog)) {
+        int8_t type = ((const DimeMessage*)buf)->type;
+        ret = conn->link->ops->send(conn->link, buf, size, g_msgprio[type]);
+    }
+    return _conn_sent(conn, buf, size, ret);
+}
+
+static int _server_send(DimeServerConnection* conn, DimeMessage* msg)
+{
+    return _conn_send(conn, (const char*)msg, g_msgsz[msg->type]);
+}
+
+/* room for an outgoing message of conn: in the link when it can go out 
+ * right away, in conn->scratch otherwise */
+static char* _conn_reserve(DimeServerConnection* conn)
+{
+    DimeLink* link = conn->link;
+    char* buf = NULL;
+    if (g_queue_is_empty(&conn->backlog)) {
+        buf = link->ops->reserve(link, link->msgsize);
+    }
+    return buf ? buf : conn->scratch;
+}
+
+static int _conn_commit(DimeServerConnection* conn, char* buf, size_t size)
+{
+    if (buf == conn->scratch) {
+        return _conn_send(conn, buf, size);
+    }
+
+    int8_t type = ((DimeMessage*)buf)->type;
+    return _conn_sent(conn, buf, size, conn->link->ops->commit(conn->link, buf, 
+                size, g_msgprio[type]));
+}
+
+/* polls readable once pid exits, -1 on kernels without pidfd */
+static int _pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static gboolean pid_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+    conn->pid_watch_id = 0; /* removed as we return FALSE */
+    dime_info("client %d exited", conn->id);
+    _reap_connection(conn);
+    return FALSE;
+}
 
 static int handle_connect(DimeServer* s, DimeMessage* msg)
 {
@@ -520,6 +1641,23 @@ static int handle_connect(DimeServer* s, DimeMessage* msg)
 
     g_return_val_if_fail(msg_conn && msg_conn->type == MSG_CONNECT, -1);
 
+    // shm and sock links connect during the handoff, once they are up the
+    // connection would replace, and free, itself
+    if (s->current) {
+        dime_warn("connection %d connects again", s->current->id);
+        return -1;
+    }
+
+    // the id of an mq client is only claimed, it must not take over the
+    // connection of a process the kernel vouched for
+    DimeServerConnection* old = (DimeServerConnection*)g_hash_table_lookup(
+            s->connections, GINT_TO_POINTER(msg_conn->id));
+    if (old && strcmp(old->link->ops->name, "mq") != 0) {
+        dime_warn("mq client claims pid %d of a %s connection", msg_conn->id, 
+                old->link->ops->name);
+        return -1;
+    }
+
     char conn_name[NAME_MAX];
     char *disp = getenv("DISPLAY");
     snprintf(conn_name, NAME_MAX, DIME_CONNECTION_MQ_NAME_TMPL, disp, msg_conn->id);
@@ -529,18 +1667,29 @@ static int handle_connect(DimeServer* s, DimeMessage* msg)
         .mq_msgsize = MSG_BUF_SIZE,
         .mq_maxmsg = MSG_MAX_NR,
     };
-    mqd_t mq = mq_open(conn_name, O_CREAT|O_WRONLY, 0664, &attr);
+    mqd_t mq = mq_open(conn_name, O_CREAT|O_WRONLY|O_NONBLOCK, 0664, &attr);
     if (mq < 0) {
         dime_warn("mq_open(%s) failed: %s", conn_name, strerror(errno));
         return -1;
     }
 
-    g_hash_table_insert(s->connections, GINT_TO_POINTER(msg_conn->id), GINT_TO_POINTER(mq));
+    DimeServerConnection* conn = _new_connection(s, msg_conn->id, 
+            dime_link_mq_new(mq, -1, MSG_BUF_SIZE));
+    conn->mq_name = g_strdup(conn_name);
+    conn->pidfd = _pidfd_open(msg_conn->id);
+    if (conn->pidfd >= 0) {
+        conn->pid_ch = _watch(conn->pidfd, G_IO_IN, pid_callback, conn, &conn->pid_watch_id);
+    }
+    _add_connection(s, conn);
 
     DimeMessageConnect resp;
     resp.type = MSG_CONNECT;
     resp.id  = msg_conn->id;
-    _send_message(mq, (DimeMessage*)&resp);
+    _server_send(conn, (DimeMessage*)&resp);
+
+    // both ends have the queue open by now, the name is of no use any more
+    // and must not outlive a client which crashes
+    mq_unlink(conn_name);
     return 0;
 }
 
@@ -548,53 +1697,137 @@ static int handle_token(DimeServer* s, DimeMessage* msg)
 {
     DimeMessageToken* msg_token = &msg->token;
 
+    DimeServerConnection* conn = s->current;
+    if (!conn) {
+        conn = (DimeServerConnection*)g_hash_table_lookup(
+                s->connections, GINT_TO_POINTER(msg_token->id));
+    }
+    g_return_val_if_fail(conn != NULL, -1);
+
     if (msg_token->type == MSG_ACQUIRE_TOKEN) {
         DimeMessageToken resp = *msg_token;
-        resp.token = s->last++; //FIXME: terrible, what if overflow and circle back
-
-        dime_debug("acquire token: conn %d", msg_token->id);
-        mqd_t mq = (mqd_t)(long)g_hash_table_lookup(s->connections, GINT_TO_POINTER(msg_token->id));
-        g_assert(mq != 0);
-
-        _send_message(mq, (DimeMessage*)&resp);
+        resp.token = _alloc_token(s, conn);
+        if (resp.token == 0) {
+            dime_warn("out of tokens, conn %d", msg_token->id);
+            return -1;
+        }
 
-        g_hash_table_insert(s->token_map, GINT_TO_POINTER(resp.token), GINT_TO_POINTER(resp.id));
+        dime_debug("acquire token %u: conn %d", resp.token, msg_token->id);
+        _server_send(conn, (DimeMessage*)&resp);
 
     } else {
-        if (g_hash_table_remove(s->token_map, GINT_TO_POINTER(msg_token->token))) {
+        // only the connection which holds it may release it
+        DimeTokenSlot* slot = _token_slot(s, msg_token->token);
+        if (slot && slot->conn == conn) {
             dime_debug("release token %d for conn %d", msg_token->token, msg_token->id);
+            _free_token(s, slot);
             //FIXME: send response ?
         }
     }
     return 0;
 }
 
-static int handle_input(DimeServer* s, DimeMessage* msg)
+/* hands the keys held in s->batch to on_input */
+static int _flush_input(DimeServer* s)
 {
-    DimeMessageInput* msg_input = &msg->input;
+    if (s->batch.count == 0) return 0;
 
-    dime_debug("client %d key %c", msg_input->token, msg_input->key);
+    DimeMessageInputBatch batch = s->batch;
+    s->batch.count = 0;
 
-    DimeMessageInputFeedback resp;
-    resp.type = MSG_INPUT_FEEDBACK;
-    resp.time = msg_input->time;//FIXME:??
-    resp.token = msg_input->token;
-    resp.result = 1;
+    dime_debug("client %d %d keys up to seq %u", batch.token, batch.count, batch.seq);
 
-    int id = (long)g_hash_table_lookup(s->token_map, GINT_TO_POINTER(msg_input->token));
-    mqd_t mq = (mqd_t)(long)g_hash_table_lookup(s->connections, GINT_TO_POINTER(id));
-    g_assert(mq != 0);
-    _send_message(mq, (DimeMessage*)&resp);
+    // on_input answers with dime_mq_server_reply_input once the keys are
+    // decoded, keys which do not go to the IM are answered right away
+    if (s->active.token == batch.token && s->callbacks && s->callbacks->on_input) {
+        return s->callbacks->on_input(s, (DimeMessage*)&batch);
+    }
 
-    if (s->active.token != msg_input->token) {
-        // we only send feedback but do not process it
-        return 0;
+    DimeMessageInputReply resp = {
+        .type = MSG_INPUT_REPLY,
+        .token = batch.token,
+        .seq = batch.seq,
+        .result = 0,
+        .kind = MSG_INVALID,
+    };
+
+    DimeServerConnection* conn = _find_connection(s, batch.token);
+    g_return_val_if_fail(conn != NULL, -1);
+    _server_send(conn, (DimeMessage*)&resp);
+    return 0;
+}
+
+static int _queue_input(DimeServer* s, uint32_t token, uint32_t seq, uint32_t time,
+        const int32_t* keys, int n)
+{
+    if (s->batch.count > 0 && (s->batch.token != token || 
+                s->batch.count + n > DIME_INPUT_BATCH_MAX)) {
+        _flush_input(s);
+    }
+
+    if (s->batch.count == 0) {
+        s->batch.type = MSG_INPUT_BATCH;
+        s->batch.flags = 0;
+        s->batch.token = token;
+    }
+
+    memcpy(s->batch.keys + s->batch.count, keys, n * sizeof(int32_t));
+    s->batch.count += n;
+    s->batch.seq = seq;
+    s->batch.time = time;
+    return 0;
+}
+
+/* a token is only used by the connection holding it. mq clients share the
+ * server queue and are not known here, they can at least not use tokens of
+ * shm or sock connections */
+static gboolean _owns_token(DimeServer* s, uint32_t token)
+{
+    DimeTokenSlot* slot = _token_slot(s, token);
+    if (!slot) {
+        dime_debug("unknown token %u", token);
+        return FALSE;
+    }
+
+    if (s->current ? slot->conn != s->current : !slot->conn->mq_name) {
+        dime_warn("token %u of connection %d used by another one", token, slot->conn->id);
+        return FALSE;
     }
+    return TRUE;
+}
+
+static int handle_input(DimeServer* s, DimeMessage* msg)
+{
+    DimeMessageInput* msg_input = &msg->input;
 
-    if (s->callbacks && s->callbacks->on_input) {
-        return s->callbacks->on_input(s, msg);
+    dime_debug("client %d key %c seq %u", msg_input->token, msg_input->key, msg_input->seq);
+    if (!_owns_token(s, msg_input->token)) return -1;
+    return _queue_input(s, msg_input->token, msg_input->seq, msg_input->time, 
+            &msg_input->key, 1);
+}
+
+static int handle_input_batch(DimeServer* s, DimeMessage* msg)
+{
+    DimeMessageInputBatch* msg_batch = &msg->input_batch;
+
+    if (msg_batch->count <= 0 || msg_batch->count > DIME_INPUT_BATCH_MAX) {
+        dime_warn("client %d sent a batch of %d keys", msg_batch->token, msg_batch->count);
+        return -1;
     }
+    if (!_owns_token(s, msg_batch->token)) return -1;
+    return _queue_input(s, msg_batch->token, msg_batch->seq, msg_batch->time, 
+            msg_batch->keys, msg_batch->count);
+}
 
+static int handle_page(DimeServer* s, DimeMessage* msg)
+{
+    DimeMessagePage* msg_page = &msg->page;
+
+    dime_debug("client %d page %d", msg_page->token, msg_page->page);
+    if (!_owns_token(s, msg_page->token)) return -1;
+    if (s->active.token == msg_page->token && s->callbacks && s->callbacks->on_page) {
+        return s->callbacks->on_page(s, msg);
+    }
     return 0;
 }
 
@@ -604,8 +1837,7 @@ static int handle_focus(DimeServer* s, DimeMessage* msg)
 
     dime_debug("client(%d) ", msg_focus->token, g_msgname[msg_focus->type]);
 
-    int id = (long)g_hash_table_lookup(s->token_map, GINT_TO_POINTER(msg_focus->token));
-    g_return_val_if_fail(id > 0, 0);
+    if (!_owns_token(s, msg_focus->token)) return -1;
 
     if (msg_focus->type == MSG_FOCUS_IN) {
         //ignore previous focused
@@ -627,8 +1859,7 @@ static int handle_enable(DimeServer* s, DimeMessage* msg)
 
     dime_debug("client(%d) enable %d", msg_enable->token, msg_enable->val);
 
-    int id = (long)g_hash_table_lookup(s->token_map, GINT_TO_POINTER(msg_enable->token));
-    g_return_val_if_fail(id > 0, 0);
+    if (!_owns_token(s, msg_enable->token)) return -1;
 
     if (s->active.token == 0) {
         s->active.token = msg_enable->token;
@@ -644,6 +1875,21 @@ static int handle_enable(DimeServer* s, DimeMessage* msg)
     return 0;
 }
 
+static int handle_disconnect(DimeServer* s, DimeMessage* msg)
+{
+    DimeServerConnection* conn = s->current;
+    if (!conn) {
+        conn = (DimeServerConnection*)g_hash_table_lookup(
+                s->connections, GINT_TO_POINTER(msg->disconnect.id));
+    }
+    g_return_val_if_fail(conn != NULL, -1);
+
+    dime_info("connection %d disconnects", conn->id);
+    // it may be the connection being drained
+    _drop_later(conn);
+    return 0;
+}
+
 static int handle_unimplemented(DimeServer* s, DimeMessage* msg)
 {
     dime_warn("handle for %s not implemented", g_msgname[msg->type]);
@@ -665,24 +1911,68 @@ static DimeServerCallback g_dispatch_table[MSG_MAX] = {
     /*MSG_DEL_IC,*/         handle_unimplemented,
     /*MSG_CURSOR,*/         handle_unimplemented,
     /*MSG_INPUT,*/          handle_input,
-    /*MSG_INPUT_FEEDBACK,*/ handle_invalid,
+    /*MSG_INPUT_REPLY,*/    handle_invalid,
+    /*MSG_INPUT_BATCH,*/    handle_input_batch,
+    /*MSG_PAGE,*/           handle_page,
 
     /*MSG_COMMIT,*/         handle_invalid,
     /*MSG_PREEDIT,*/        handle_invalid,
     /*MSG_PREEDIT_CLEAR,*/  handle_invalid,
+    /*MSG_PREEDIT_DELTA,*/  handle_invalid,
+    /*MSG_CANDIDATES,*/     handle_invalid,
     /*MSG_FORWARD,*/        handle_invalid,
 
     /*MSG_ACQUIRE_TOKEN,*/  handle_token,
     /*MSG_RELEASE_TOKEN,*/  handle_token,
     /*MSG_CONNECT,*/        handle_connect,
 
-    /*MSG_DISCONNECT,*/     handle_unimplemented,
+    /*MSG_DISCONNECT,*/     handle_disconnect,
     /*MSG_SHUTDOWN,*/       handle_invalid,
 };
 
 static gboolean dispatch(DimeServer* s, DimeMessage* msg)
 {
-    return g_dispatch_table[msg->type](s, msg) == 0;
+    // held keys go first, a focus change or release must not overtake them
+    if (msg->type != MSG_INPUT && msg->type != MSG_INPUT_BATCH) {
+        _flush_input(s);
+    }
+    if (g_dispatch_table[msg->type](s, msg) != 0) {
+        return FALSE;
+    }
+
+    // sync requests other than keys are answered by echoing them, they
+    // all start with the token
+    if ((msg->flags & DIME_MSG_FLAG_SYNC) && (msg->type == MSG_ENABLE || 
+                msg->type == MSG_FOCUS_IN || msg->type == MSG_FOCUS_OUT || 
+                msg->type == MSG_PAGE)) {
+        DimeServerConnection* conn = _find_connection(s, msg->focus.token);
+        if (conn) _server_send(conn, msg);
+    }
+    return TRUE;
+}
+
+/* handles what is pending on link, up to MSG_DRAIN_MAX messages. each one
+ * is copied out and released before it is dispatched */
+static void server_drain(DimeServer* srv, DimeLink* link, DimeServerConnection* conn)
+{
+    DimeMessage msg;
+    int n = 0, ret;
+
+    // messages to the server carry no text, so nothing points into the link
+    srv->current = conn;
+    while (n < MSG_DRAIN_MAX && (ret = _receive_message(link, &msg)) <= 0) {
+        if (ret == 0) {
+            link->ops->release(link);
+            dime_debug("handle %s", g_msgname[msg.type]);
+            dispatch(srv, &msg);
+        }
+        n++;
+    }
+    _flush_input(srv);
+    srv->current = NULL;
+
+    if (n == MSG_DRAIN_MAX) link->ops->defer(link);
+    _count_drain(&srv->stats, n);
 }
 
 static gboolean server_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
@@ -693,29 +1983,173 @@ static gboolean server_callback(GIOChannel *ch, GIOCondition condition, gpointer
     }
 
     DimeServer* srv = (DimeServer*)data;
+    server_drain(srv, srv->link, NULL);
+    return TRUE;
+}
+
+static gboolean _hang_up(DimeServerConnection* conn)
+{
+    dime_info("connection %d hung up", conn->id);
+    _reap_connection(conn);
+    return FALSE;
+}
+
+static void _find_dead(gpointer key, gpointer value, gpointer user_data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)value;
+    if (conn->mq_name && conn->pidfd < 0 && kill(conn->id, 0) < 0 && errno == ESRCH) {
+        *(GSList**)user_data = g_slist_prepend(*(GSList**)user_data, conn);
+    }
+}
+
+/* mq clients which exited without MSG_DISCONNECT, when there is no pidfd */
+static gboolean reap_callback(gpointer data)
+{
+    DimeServer* s = (DimeServer*)data;
+
+    GSList* dead = NULL;
+    g_hash_table_foreach(s->connections, _find_dead, &dead);
+    for (GSList* l = dead; l; l = l->next) {
+        DimeServerConnection* conn = (DimeServerConnection*)l->data;
+        dime_info("client %d is gone", conn->id);
+        _reap_connection(conn);
+    }
+    g_slist_free(dead);
+    return TRUE;
+}
+
+/* queues of mq clients which died while no server was around */
+static void _unlink_stale_queues(const char* disp)
+{
+    DIR* dir = opendir("/dev/mqueue");
+    if (!dir) return;
+
+    // names in the fs lack the leading slash, cut it and the pid
+    char prefix[NAME_MAX];
+    int len = snprintf(prefix, sizeof prefix, DIME_CONNECTION_MQ_NAME_TMPL, disp, 0) - 2;
+
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+        if (strncmp(e->d_name, prefix + 1, len) != 0) continue;
+
+        char* end;
+        long pid = strtol(e->d_name + len, &end, 10);
+        if (*end || pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
 
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec++;
-    ssize_t nread = mq_timedreceive(srv->mq, srv->msgbuf, srv->msgsize, NULL, &timeout);
-    if (nread > 0) {
-        DimeMessage* m = (DimeMessage*)srv->msgbuf;
-        dime_debug("handle %s", g_msgname[m->type]);
-        dispatch(srv, m);
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof name, "/%s", e->d_name);
+        dime_info("unlink stale %s", name);
+        mq_unlink(name);
+    }
+    closedir(dir);
+}
+
+static gboolean connection_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+
+    if (condition & G_IO_IN) {
+        server_drain(conn->server, conn->link, conn);
+    }
+
+    if (condition & (G_IO_HUP | G_IO_ERR)) {
+        conn->watch_id = 0; /* removed as we return FALSE */
+        return _hang_up(conn);
+    }
+    return TRUE;
+}
+
+static gboolean connection_hup_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+    conn->sock_watch_id = 0;
+    return _hang_up(conn);
+}
+
+/* the first message on an accepted socket: MSG_CONNECT, along with the 
+ * fds of a shm link, or alone to keep talking over the socket */
+static gboolean handoff_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)data;
+    DimeServer* s = conn->server;
+
+    DimeMessageConnect msg_conn = {0};
+    int fds[DIME_LINK_MAX_FDS], nfds = 0;
+    int ret = dime_link_handoff(conn->sock, &msg_conn, sizeof msg_conn, fds, &nfds);
+    if (ret > 0 && !(condition & (G_IO_HUP | G_IO_ERR))) {
+        return TRUE;
+    }
+
+    g_io_channel_unref(conn->sock_ch);
+    conn->sock_ch = NULL;
+    conn->sock_watch_id = 0; /* removed as we return FALSE */
+
+    if (ret == 0 && msg_conn.type == MSG_CONNECT) {
+        if (nfds == 3) {
+            conn->link = dime_link_shm_attach(fds, MSG_BUF_SIZE);
+        } else if (nfds == 0) {
+            conn->link = dime_link_sock_new(conn->sock, MSG_BUF_SIZE);
+            conn->sock = -1;
+        }
+    }
+
+    if (!conn->link) {
+        dime_warn("bad handoff from pid %d", conn->id);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        _free_connection(conn);
+        return FALSE;
+    }
+
+    dime_debug("%s connection from pid %d", conn->link->ops->name, conn->id);
+    if (conn->sock >= 0) {
+        conn->ch = _watch(conn->link->fd, G_IO_IN, connection_callback, conn, &conn->watch_id);
+        conn->sock_ch = _watch(conn->sock, G_IO_HUP | G_IO_ERR, connection_hup_callback,
+                conn, &conn->sock_watch_id);
     } else {
-        dime_debug("mq(%d), errno: %d, %s", srv->mq, errno, strerror(errno));
+        conn->ch = _watch(conn->link->fd, G_IO_IN | G_IO_HUP | G_IO_ERR, connection_callback,
+                conn, &conn->watch_id);
     }
+    _add_connection(s, conn);
 
+    // the client checks the id it sent
+    DimeMessageConnect resp = { .type = MSG_CONNECT, .id = msg_conn.id };
+    _server_send(conn, (DimeMessage*)&resp);
+    return FALSE;
+}
+
+static gboolean listen_callback(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+    DimeServer* s = (DimeServer*)data;
+
+    for (int n = 0; n < MSG_DRAIN_MAX; n++) {
+        int pid;
+        int sock = dime_link_accept(s->listener, &pid);
+        if (sock < 0) {
+            if (errno == EACCES) continue;
+            break;
+        }
+
+        // not in connections before the handoff
+        DimeServerConnection* conn = _new_connection(s, pid, NULL);
+        conn->sock = sock;
+        conn->sock_ch = _watch(sock, G_IO_IN | G_IO_HUP | G_IO_ERR, handoff_callback, 
+                conn, &conn->sock_watch_id);
+    }
     return TRUE;
 }
 
 DimeServer* dime_mq_server_new()
 {
     DimeServer* s = (DimeServer*)calloc(1, sizeof(DimeServer));
-    //NOTE: I will use a random start number later
-    s->initial = s->last = 100;
-    s->connections = g_hash_table_new(g_direct_hash, g_direct_equal);
-    s->token_map = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->free_slot = TOKEN_NO_SLOT;
+    s->connections = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _free_connection);
+
+    // a descriptor or three per client, let thousands of them in
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
     char *disp = getenv("DISPLAY");
     snprintf(s->mq_name, NAME_MAX, DIME_SERVER_MQ_NAME_TMPL, disp);
@@ -727,55 +2161,90 @@ DimeServer* dime_mq_server_new()
         .mq_msgsize = MSG_BUF_SIZE,
         .mq_maxmsg = MSG_MAX_NR,
     };
-    s->mq = mq_open(s->mq_name, O_CREAT|O_RDONLY, 0664, &attr);
+    s->mq = mq_open(s->mq_name, O_CREAT|O_RDONLY|O_NONBLOCK, 0664, &attr);
     if (s->mq < 0) {
         dime_warn("mq_open failed: %s", strerror(errno));
         return NULL;
     }
 
     mq_getattr(s->mq, &attr);
-    s->msgsize = attr.mq_msgsize;
-    s->msgbuf = (char*)malloc(s->msgsize);
+    s->link = dime_link_mq_new(-1, s->mq, attr.mq_msgsize);
 
     s->ch = g_io_channel_unix_new(s->mq);
     g_io_channel_set_encoding(s->ch, NULL, NULL);
     g_io_channel_set_buffered(s->ch, FALSE);
     s->watch_id = g_io_add_watch(s->ch, G_IO_IN, server_callback, s);
 
+    // shm and sock clients start here, mq clients still work without it
+    s->listener = dime_link_listen(s->mq_name);
+    if (s->listener >= 0) {
+        s->listen_ch = _watch(s->listener, G_IO_IN, listen_callback, s, &s->listen_watch_id);
+    }
+
+    _unlink_stale_queues(disp);
+    s->reap_id = g_timeout_add_seconds(REAP_INTERVAL, reap_callback, s);
+
     return s;
 }
 
 static void _close_connection(gpointer key, gpointer value, gpointer user_data)
 {
     int id = GPOINTER_TO_INT(key);
-    mqd_t mq = GPOINTER_TO_INT(value);
-    DimeServer* s = (DimeServer*)user_data;
+    DimeServerConnection* conn = (DimeServerConnection*)value;
 
-    dime_debug("id(%d) mq(%d)", id, mq);
+    dime_debug("id(%d) %s", id, conn->link->ops->name);
     DimeMessageShutdown resp = {
         .type = MSG_SHUTDOWN,
         .flags = 0
     };
-    _send_message(mq, (DimeMessage*)&resp);
-    mq_close(mq);
+    _server_send(conn, (DimeMessage*)&resp);
 }
 
 void dime_mq_server_close(DimeServer* s)
 {
-    //TODO: disconnect all clients or not ?
+    g_source_remove(s->reap_id);
     g_hash_table_foreach(s->connections, _close_connection, s);
     g_hash_table_remove_all(s->connections);
-    g_hash_table_remove_all(s->token_map);
+
+    if (s->listener >= 0) {
+        g_source_remove(s->listen_watch_id);
+        g_io_channel_unref(s->listen_ch);
+        close(s->listener);
+    }
 
     g_source_remove(s->watch_id);
-    g_io_channel_shutdown(s->ch, TRUE, NULL);
     g_io_channel_unref(s->ch);
-    free(s->msgbuf);
-    mq_close(s->mq);
+    s->link->ops->free(s->link); /* closes s->mq */
     mq_unlink(s->mq_name);
+    g_hash_table_destroy(s->connections);
+    for (uint32_t i = 0; i < s->nslots; i++) {
+        if (s->slots[i].preedit.text) g_string_free(s->slots[i].preedit.text, TRUE);
+    }
+    free(s->slots);
     free(s);
 }
 
+void dime_mq_server_stats(DimeServer* s, DimeDrainStats* st)
+{
+    *st = s->stats;
+}
+
+static void _add_queued(gpointer key, gpointer value, gpointer user_data)
+{
+    DimeServerConnection* conn = (DimeServerConnection*)value;
+    DimeSendStats* st = (DimeSendStats*)user_data;
+    st->queued += conn->link->ops->queued(conn->link);
+    st->backlog += g_queue_get_length(&conn->backlog);
+}
+
+void dime_mq_server_send_stats(DimeServer* s, DimeSendStats* st)
+{
+    *st = s->sent;
+    st->queued = 0;
+    st->backlog = 0;
+    g_hash_table_foreach(s->connections, _add_queued, st);
+}
+
 int dime_mq_server_set_callbacks(DimeServer* s, DimeServerCallbacks cbs)
 {
     if (!s->callbacks) {
@@ -785,37 +2254,286 @@ int dime_mq_server_set_callbacks(DimeServer* s, DimeServerCallbacks cbs)
     return 0;
 }
 
-int dime_mq_server_send(DimeServer* s, int token, int8_t flag, int8_t type, ...)
+static int _write_cstr(char* buf, int len, gpointer data)
 {
-    va_list(ap);
-    va_start(ap, type);
+    const char* text = (const char*)data;
+    int n = strlen(text) + 1;
+    if (n > len) return -1;
+
+    memcpy(buf, text, n);
+    return n;
+}
 
-    int id = (long)g_hash_table_lookup(s->token_map, GINT_TO_POINTER(token));
-    mqd_t mq_cli = (mqd_t)(long)g_hash_table_lookup(s->connections, GINT_TO_POINTER(id));
-    g_assert(mq_cli != 0);
+/* page 0 of the candidates for a MSG_INPUT_REPLY */
+typedef struct {
+    int page_count;
+    const char** words;
+    int n;
+} DimeReplyPage;
+
+/* whole words only, returns bytes written or -1 if they do not all fit */
+static int _write_page(char* buf, size_t len, const DimeReplyPage* page)
+{
+    size_t used = 0;
+    for (int i = 0; i < page->n; i++) {
+        size_t n = strlen(page->words[i]) + 1;
+        if (used + n > len) return -1;
+
+        memcpy(buf + used, page->words[i], n);
+        used += n;
+    }
+    return used;
+}
+
+/* sends head with the text writer produces behind it. text_len of head is 
+ * filled in here. page is put behind the text of a MSG_INPUT_REPLY if it
+ * fits, has_page of head tells whether it did */
+static int _send_text(DimeServer* s, int token, DimeMessage* head, 
+        DimeTextWriter writer, gpointer data, const DimeReplyPage* page)
+{
+    int8_t type = head->type;
+
+    DimeServerConnection* conn = _find_connection(s, token);
+    g_return_val_if_fail(conn != NULL, -1);
+
+    // the message is built where the link sends it from, for shm links
+    // that is the ring the client reads it from
+    DimeLink* link = conn->link;
+    char* buf = _conn_reserve(conn);
+
+    int text_len = writer ? writer(buf + g_msgsz[type], link->msgsize - g_msgsz[type], data) : 0;
+    if (text_len < 0) {
+        dime_warn("text of %s too long for token %d", g_msgname[type], token);
+        return -1;
+    }
 
     switch (type) {
-        case MSG_COMMIT: {
-            DimeMessageCommit* commit = (DimeMessageCommit*)s->msgbuf;
-            commit->type = MSG_COMMIT;
-            commit->flags = 0;
-            commit->token = token;
-            char *data = va_arg(ap, char*);
-            strcpy(s->msgbuf + g_msgsz[MSG_COMMIT], data);
-            commit->text_len = va_arg(ap, int);
-            _send_message(mq_cli, (DimeMessage*)commit, commit->text_len);
-            break;
+        case MSG_COMMIT: head->commit.text_len = text_len; break;
+        case MSG_PREEDIT: head->preedit.text_len = text_len; break;
+        case MSG_PREEDIT_DELTA: head->preedit_delta.text_len = text_len; break;
+        case MSG_INPUT_REPLY: head->input_reply.text_len = text_len; break;
+        default: g_assert_not_reached(); break;
+    }
+
+    int used = 0;
+    if (page && page->n <= DIME_CANDIDATES_MAX) {
+        char* cands = buf + g_msgsz[type] + text_len;
+        used = _write_page(cands, link->msgsize - g_msgsz[type] - text_len, page);
+        if (used >= 0) {
+            head->input_reply.has_page = 1;
+            head->input_reply.count = page->n;
+            head->input_reply.page_count = page->page_count;
+            head->input_reply.cands_len = used;
+        } else {
+            used = 0;
+        }
+    }
+
+    memcpy(buf, head, g_msgsz[type]);
+    return _conn_commit(conn, buf, g_msgsz[type] + text_len + used);
+}
+
+/* a commit empties the preedit on both ends */
+static void _committed(DimeServer* s, uint32_t token, int ret)
+{
+    DimePreeditState* st = _preedit_state(s, token);
+    if (!st) {
+        return;
+    } else if (ret < 0 && st->text) {
+        g_string_free(st->text, TRUE);
+        st->text = NULL;
+    } else if (ret == 0) {
+        if (!st->text) st->text = g_string_new("");
+        g_string_truncate(st->text, 0);
+    }
+}
+
+typedef struct {
+    const char* text;
+    int len;
+} DimeBytes;
+
+static int _write_bytes(char* buf, int len, gpointer data)
+{
+    DimeBytes* b = (DimeBytes*)data;
+    if (b->len + 1 > len) return -1;
+
+    memcpy(buf, b->text, b->len);
+    buf[b->len] = 0;
+    return b->len + 1;
+}
+
+/* head is MSG_PREEDIT or MSG_INPUT_REPLY of kind MSG_PREEDIT, it is turned 
+ * into a delta against the last preedit of token unless a full one is due */
+static int _send_preedit(DimeServer* s, int token, DimeMessage* head, 
+        DimeTextWriter writer, gpointer data, const DimeReplyPage* page)
+{
+    // the whole preedit is needed to compare, so it is not written in place
+    char text[MSG_BUF_SIZE];
+    int n = writer(text, sizeof text, data);
+    if (n < 0) {
+        dime_warn("preedit too long for token %d", token);
+        return -1;
+    }
+    n = strnlen(text, n);
+
+    DimePreeditState* st = _preedit_state(s, token);
+    g_return_val_if_fail(st != NULL, -1);
+    DimeBytes bytes = { text, n };
+    gboolean full = !st->text || st->deltas >= PREEDIT_SYNC_EVERY;
+    if (!full) {
+        // the changed middle between a common prefix and suffix
+        const char* old = st->text->str;
+        int len = st->text->len, p = 0, q = 0;
+        while (p < len && p < n && old[p] == text[p]) p++;
+        while (q < len - p && q < n - p && old[len - 1 - q] == text[n - 1 - q]) q++;
+
+        DimePreeditDelta delta = { .offset = p, .del = len - p - q, .len = n + 1 };
+        bytes.text = text + p;
+        bytes.len = n - p - q;
+
+        if (head->type == MSG_PREEDIT) {
+            head->type = MSG_PREEDIT_DELTA;
+            head->preedit_delta.delta = delta;
+        } else {
+            head->input_reply.kind = MSG_PREEDIT_DELTA;
+            head->input_reply.delta = delta;
+        }
+    }
+
+    int ret = _send_text(s, token, head, _write_bytes, &bytes, page);
+    if (ret < 0) {
+        // the client may have missed it, the next one is full
+        if (st->text) g_string_free(st->text, TRUE);
+        st->text = NULL;
+        return ret;
+    }
+
+    if (!st->text) st->text = g_string_sized_new(n);
+    g_string_truncate(st->text, 0);
+    g_string_append_len(st->text, text, n);
+    st->deltas = full ? 0 : st->deltas + 1;
+    return ret;
+}
+
+int dime_mq_server_send_text(DimeServer* s, int token, int8_t flag, int8_t type, 
+        DimeTextWriter writer, gpointer data)
+{
+    g_return_val_if_fail(type == MSG_COMMIT || type == MSG_PREEDIT, -1);
+
+    DimeMessage head = { .type = type, .flags = flag };
+    if (type == MSG_PREEDIT) {
+        head.preedit.token = token;
+        return _send_preedit(s, token, &head, writer, data, NULL);
+    }
+
+    head.commit.token = token;
+    int ret = _send_text(s, token, &head, writer, data, NULL);
+    _committed(s, token, ret);
+    return ret;
+}
+
+int dime_mq_server_send_candidates(DimeServer* s, int token, int page, int page_count,
+        const char** words, int n)
+{
+    g_return_val_if_fail(n >= 0 && n <= DIME_CANDIDATES_MAX, -1);
+
+    DimeServerConnection* conn = _find_connection(s, token);
+    g_return_val_if_fail(conn != NULL, -1);
+
+    DimeLink* link = conn->link;
+    size_t room = link->msgsize - g_msgsz[MSG_CANDIDATES];
+    DimePreeditState* st = _preedit_state(s, token);
+
+    // as many whole words per message as fit, so at most n messages
+    int i = 0;
+    do {
+        char* buf = _conn_reserve(conn);
+
+        DimeMessageCandidates head = {
+            .type = MSG_CANDIDATES,
+            .token = token,
+            .seq = st->seq,
+            .page = page,
+            .page_count = page_count,
+            .count = n,
+            .first = i,
+        };
+        char* text = buf + g_msgsz[MSG_CANDIDATES];
+        size_t used = 0;
+
+        for (; i < n; i++) {
+            size_t len = strlen(words[i]);
+            if (used + len + 1 > room) {
+                if (head.n > 0) break;
+
+                // alone in a message and still too long, cut it at a
+                // character boundary
+                len = room - 1;
+                while (len > 0 && (words[i][len] & 0xc0) == 0x80) len--;
+            }
+
+            head.offsets[head.n++] = used;
+            memcpy(text + used, words[i], len);
+            text[used + len] = 0;
+            used += len + 1;
         }
 
+        head.text_len = used;
+        memcpy(buf, &head, g_msgsz[MSG_CANDIDATES]);
+        // a page missing a part is dropped by the client as a whole
+        if (_conn_commit(conn, buf, g_msgsz[MSG_CANDIDATES] + used) < 0) {
+            return -1;
+        }
+    } while (i < n);
+
+    return 0;
+}
+
+int dime_mq_server_reply_input(DimeServer* s, int token, uint32_t seq, int8_t kind,
+        DimeTextWriter writer, gpointer data, int page_count, const char** words, int n)
+{
+    g_return_val_if_fail(kind == MSG_COMMIT || kind == MSG_PREEDIT || kind == MSG_INVALID, -1);
+
+    DimeMessage head = { .input_reply = {
+        .type = MSG_INPUT_REPLY,
+        .token = token,
+        .seq = seq,
+        .result = 1,
+        .kind = kind,
+    } };
+
+    DimePreeditState* st = _preedit_state(s, token);
+    if (st) st->seq = seq;
+
+    DimeReplyPage page = { page_count, words, n };
+    int ret;
+    if (kind == MSG_PREEDIT) {
+        ret = _send_preedit(s, token, &head, writer, data, n >= 0 ? &page : NULL);
+    } else {
+        ret = _send_text(s, token, &head, kind == MSG_INVALID ? NULL : writer, data,
+                n >= 0 ? &page : NULL);
+        if (kind == MSG_COMMIT) _committed(s, token, ret);
+    }
+
+    if (ret == 0 && n >= 0 && !head.input_reply.has_page) {
+        ret = dime_mq_server_send_candidates(s, token, 0, page_count, words, n);
+    }
+    return ret;
+}
+
+int dime_mq_server_send(DimeServer* s, int token, int8_t flag, int8_t type, ...)
+{
+    va_list(ap);
+    va_start(ap, type);
+
+    int ret = 0;
+    switch (type) {
+        case MSG_COMMIT:
         case MSG_PREEDIT: {
-            DimeMessagePreedit* preedit = (DimeMessagePreedit*)s->msgbuf;
-            preedit->type = MSG_PREEDIT;
-            preedit->flags = 0;
-            preedit->token = token;
             char *data = va_arg(ap, char*);
-            strcpy(s->msgbuf + g_msgsz[MSG_PREEDIT], data);
-            preedit->text_len = va_arg(ap, int);
-            _send_message(mq_cli, (DimeMessage*)preedit, preedit->text_len);
+            va_arg(ap, int); /* text_len, recomputed while copying */
+            ret = dime_mq_server_send_text(s, token, flag, type, _write_cstr, data);
             break;
         }
 
@@ -823,6 +2541,5 @@ int dime_mq_server_send(DimeServer* s, int token, int8_t flag, int8_t type, ...)
     }
 
     va_end(ap);
-    return 0;
+    return ret;
 }
-
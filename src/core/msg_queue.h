@@ -22,11 +22,15 @@ typedef enum {
     MSG_DEL_IC,
     MSG_CURSOR,
     MSG_INPUT,
-    MSG_INPUT_FEEDBACK,
+    MSG_INPUT_REPLY,
+    MSG_INPUT_BATCH,
+    MSG_PAGE,
 
     MSG_COMMIT,
     MSG_PREEDIT,
     MSG_PREEDIT_CLEAR,
+    MSG_PREEDIT_DELTA,
+    MSG_CANDIDATES,
     MSG_FORWARD,
 
     MSG_ACQUIRE_TOKEN,
@@ -66,18 +70,71 @@ typedef struct {
     int8_t flags;
 
     uint32_t token; /* mark client */
+    uint32_t seq; /* increasing per token, filled by client library */
     int32_t key;
     uint32_t time;
 } DimeMessageInput;
 
+/* keys typed in a burst, e.g pasted or auto repeated. the server also 
+ * merges MSG_INPUT of one token which are queued together into one batch, 
+ * and hands only batches to on_input.
+ **/
+#define DIME_INPUT_BATCH_MAX 16
+
+typedef struct {
+    int8_t type;
+    int8_t flags;
+
+    uint32_t token; /* mark client */
+    uint32_t seq; /* of the last key, the ones before it count down */
+    uint32_t time;
+    int8_t count;
+    int32_t keys[DIME_INPUT_BATCH_MAX];
+} DimeMessageInputBatch;
+
+/* asks for a page of candidates of the current composition */
+typedef struct {
+    int8_t type;
+    int8_t flags;
+
+    uint32_t token; /* mark client */
+    uint16_t page;
+} DimeMessagePage;
+
+/* a preedit as a change of the previous one of the token: del bytes at 
+ * offset are replaced by the text of the message. the server library sends
+ * these in place of MSG_PREEDIT, with a full MSG_PREEDIT every now and then,
+ * and the client library rebuilds the whole preedit before on_preedit.
+ **/
+typedef struct {
+    uint16_t offset;
+    uint16_t del;
+    uint16_t len; /* of the whole preedit afterwards, with NUL */
+} DimePreeditDelta;
+
+/* the only answer to MSG_INPUT. one reply may cover several keys, it acks 
+ * every key of the token up to seq, and carries what they produced. page 0
+ * of the candidates rides along behind the text when it fits, the client
+ * library hands it to on_candidates right after the reply.
+ **/
 typedef struct {
     int8_t type;
     int8_t flags;
 
     uint32_t token; /* mark client */
-    uint32_t time; /* timestamp feedback sent */
-    int result;
-} DimeMessageInputFeedback;
+    uint32_t seq; /* of the last key handled */
+    int8_t result; /* 1 if the keys went to the IM, 0 if the client should 
+                      handle them itself */
+    int8_t kind; /* MSG_PREEDIT, MSG_COMMIT or MSG_INVALID for no text, on
+                    the wire also MSG_PREEDIT_DELTA */
+    DimePreeditDelta delta; /* kind MSG_PREEDIT_DELTA only */
+    uint8_t has_page; /* 1 if page 0 follows text */
+    uint8_t count; /* candidates on it */
+    uint16_t page_count; /* see Candidates.page_count */
+    uint16_t cands_len; /* NUL terminated candidates right after text_len */
+    char* text; /* see Commit.text */
+    int text_len;
+} DimeMessageInputReply;
 
 typedef struct {
     int8_t type;
@@ -114,6 +171,41 @@ typedef struct {
     uint32_t token; /* mark client */
 } DimeMessagePreeditClear;
 
+/* one page of candidates. the strings are packed NUL terminated in text, 
+ * offsets tells where each one starts. a page which does not fit one 
+ * message is split into at most count messages, each with a run of whole 
+ * candidates, which the client library puts together before on_candidates.
+ * the client library drops a page older than the last reply it got.
+ **/
+#define DIME_CANDIDATES_MAX 16
+
+typedef struct {
+    int8_t type;
+    int8_t flags;
+
+    uint32_t token; /* mark client */
+    uint32_t seq; /* of the reply to the keys the page is for */
+    uint16_t page;
+    uint16_t page_count; /* may be an upper bound */
+    uint8_t count; /* candidates on the page */
+    uint8_t first; /* index on the page of the first one in this message */
+    uint8_t n; /* candidates in this message */
+    uint16_t offsets[DIME_CANDIDATES_MAX]; /* into text, of first + i */
+    char* text; /* see Commit.text */
+    int text_len;
+} DimeMessageCandidates;
+
+/* only seen by the client library, see DimePreeditDelta */
+typedef struct {
+    int8_t type;
+    int8_t flags;
+
+    uint32_t token; /* mark client */
+    DimePreeditDelta delta;
+    char* text; /* see Commit.text */
+    int text_len;
+} DimeMessagePreeditDelta;
+
 typedef struct {
     int8_t type;
     int8_t flags;
@@ -154,7 +246,8 @@ typedef struct {
     uintptr_t outband; /* internal use, provided by client */
 } DimeMessageToken;
 
-/* flags for DimeMessage */
+/* flags for DimeMessage. the sender of a SYNC request waits for its answer:
+ * the reply of keys, the server echoing it back for enable, focus and page */
 #define DIME_MSG_FLAG_SYNC   0x01
 
 typedef union {
@@ -167,14 +260,19 @@ typedef union {
     DimeMessageFocus focus;
     DimeMessageIc ic;
     DimeMessageInput input;
-    DimeMessageInputFeedback input_feedback;
+    DimeMessageInputReply input_reply;
+    DimeMessageInputBatch input_batch;
     DimeMessageCursor cursor;
     DimeMessageCommit commit;
     DimeMessagePreedit preedit;
     DimeMessagePreeditClear preedit_clear;
+    DimeMessagePreeditDelta preedit_delta;
+    DimeMessagePage page;
+    DimeMessageCandidates candidates;
     DimeMessageForward forward;
 
     DimeMessageConnect connect;
+    DimeMessageDisconnect disconnect;
     DimeMessageToken token;
 } DimeMessage;
 
@@ -182,6 +280,33 @@ typedef union {
 typedef struct _DimeServer DimeServer;
 typedef struct _DimeClient DimeClient;
 
+#define DIME_DRAIN_HIST 8
+
+/* how many messages each wakeup of a receiving queue handled */
+typedef struct {
+    uint64_t wakeups;
+    uint64_t messages;
+    uint32_t max_batch;
+    uint64_t capped; /* wakeups which left messages for the next one */
+    uint64_t batches[DIME_DRAIN_HIST]; /* by messages handled, the last
+                                          bucket takes the rest */
+} DimeDrainStats;
+
+/* what became of messages handed to the outgoing queues. sends never block,
+ * when a queue is full low priority messages are dropped or replaced by a
+ * newer one. the server keeps the others in a backlog per connection, the 
+ * client fails them */
+typedef struct {
+    uint64_t sent;
+    uint64_t dropped;
+    uint64_t coalesced; /* replaced before they got out */
+    uint64_t failed;
+    uint64_t backlogged; /* waited in a backlog before they were sent */
+    uint64_t hung; /* connections dropped as their backlog overflowed */
+    uint64_t queued; /* bytes waiting for the peers when asked */
+    uint64_t backlog; /* messages waiting in backlogs when asked */
+} DimeSendStats;
+
 // client api
 
 typedef gboolean (*DimeMessageCallback)(DimeClient*, DimeMessage*);
@@ -193,6 +318,11 @@ struct _DimeMessageCallbacks {
     DimeMessageCallback on_preedit_clear;
     DimeMessageCallback on_forward;
     DimeMessageCallback on_enable;
+    /* MSG_INPUT_REPLY. if it is not set, the text of a reply goes to 
+     * on_preedit or on_commit instead */
+    DimeMessageCallback on_input_reply;
+    /* a whole page, after every preedit and when asked for */
+    DimeMessageCallback on_candidates;
 };
 
 /* one connection per process, shared by all clients after connection.
@@ -200,7 +330,9 @@ struct _DimeMessageCallbacks {
  **/
 int dime_mq_connect();
 int dime_mq_disconnect();
-/* one connection can spawn multiple clients, each with one unique token as UUID */
+/* one connection can spawn multiple clients, each with one unique token as UUID.
+ * clients can live on different threads, but each one is used by one thread
+ * at a time. callbacks run on whichever thread is receiving */
 DimeClient* dime_mq_acquire_token();
 int dime_mq_release_token(DimeClient*);
 int dime_mq_client_is_valid(DimeClient*);
@@ -210,25 +342,65 @@ int dime_mq_client_is_focused(DimeClient*);
 int dime_mq_client_enable(DimeClient*);
 int dime_mq_client_focus(DimeClient*, gboolean val);
 int dime_mq_client_key(DimeClient*, int key, uint32_t time); //sync
+/* keys can be pipelined, replies are matched by seq */
 int dime_mq_client_key_async(DimeClient*, int key, uint32_t time);
+/* sends n keys in as few messages as possible, async */
+int dime_mq_client_keys(DimeClient*, const int32_t* keys, int n, uint32_t time);
+/* keys sent and not replied yet */
+uint32_t dime_mq_client_pending(DimeClient*);
+/* waits until every key sent got its reply */
+int dime_mq_client_wait(DimeClient*);
+/* asks for a page of candidates, it comes to on_candidates */
+int dime_mq_client_page(DimeClient*, int page);
+/* candidate i of the message, counted from its first one */
+const char* dime_mq_candidate(const DimeMessageCandidates*, int i);
 int dime_mq_client_send(DimeClient*, int8_t flag, int8_t type, ...);
 int dime_mq_client_set_receive_callbacks(DimeClient*, DimeMessageCallbacks cbs);
+/* of the connection of this process */
+void dime_mq_client_stats(DimeDrainStats*);
+void dime_mq_client_send_stats(DimeSendStats*);
 
 // server api
 typedef gboolean (*DimeServerCallback)(DimeServer*, DimeMessage*);
 
 typedef struct _DimeServerCallbacks DimeServerCallbacks;
 struct _DimeServerCallbacks {
-    DimeServerCallback on_input;
+    DimeServerCallback on_input; /* gets MSG_INPUT_BATCH */
+    DimeServerCallback on_page;
     DimeServerCallback on_enable;
     DimeServerCallback on_focus;
     DimeServerCallback on_cursor;
+    DimeServerCallback on_release; /* gets MSG_RELEASE_TOKEN once a token is
+                                      freed, by its client or as it is reaped */
 };
 DimeServer* dime_mq_server_new();
 void dime_mq_server_close(DimeServer* s);
 int dime_mq_server_set_callbacks(DimeServer*, DimeServerCallbacks cbs);
+void dime_mq_server_stats(DimeServer*, DimeDrainStats*);
+void dime_mq_server_send_stats(DimeServer*, DimeSendStats*);
 int dime_mq_server_send(DimeServer*, int token, int8_t flag, int8_t type, ...);
 
+/* writes text payload in place into the outgoing message, at most len bytes 
+ * including the trailing NUL. returns bytes written (with NUL) or -1 if the 
+ * text does not fit.
+ **/
+typedef int (*DimeTextWriter)(char* buf, int len, gpointer data);
+/* MSG_COMMIT or MSG_PREEDIT only, text is produced by writer directly into 
+ * the message buffer, so there is no intermediate copy */
+int dime_mq_server_send_text(DimeServer*, int token, int8_t flag, int8_t type, 
+        DimeTextWriter writer, gpointer data);
+/* n words of page, split over as many messages as needed. a single word 
+ * too long for a message is cut */
+int dime_mq_server_send_candidates(DimeServer*, int token, int page, int page_count,
+        const char** words, int n);
+/* answers MSG_INPUT of token up to seq, along with the MSG_PREEDIT or 
+ * MSG_COMMIT text the keys produced, or MSG_INVALID and no writer. keys of
+ * a token which are not answered one by one are acked by a later reply.
+ * n words are page 0 of the candidates, they go in the reply if they fit
+ * and as MSG_CANDIDATES otherwise. n < 0 sends no page */
+int dime_mq_server_reply_input(DimeServer*, int token, uint32_t seq, int8_t kind,
+        DimeTextWriter writer, gpointer data, int page_count, const char** words, int n);
+
 G_END_DECLS
 
 #endif /* ifndef _DIME_MSG_QUEUE_H */
@@ -8,19 +8,23 @@
 #include <sys/stat.h>
 #include <locale.h>
 #include <mqueue.h>
+#include <signal.h>
+#include <glib-unix.h>
 
 #include <iostream>
+#include <sstream>
 #include <unordered_map>
 #include <string>
 #include <vector>
-
-#include <QtSql>
+#include <algorithm>
 
 #include "msg_queue.h"
 #include "log.h"
 
-#include "py.h"
 #include "hmm.h"
+#include "worker.h"
+#include "engine.h"
+#include "prewarm.h"
 using namespace std;
 using namespace dime;
 
@@ -34,6 +38,15 @@ char *p1 = py;
 char *p2 = py;
 static DimeClient* c1 = NULL, *c2 = NULL;
 static DimeServer* s = NULL;
+static gint64 started; /* when the engines began to init */
+
+#define BENCH_KEYS "tianqi duanyu gongju tianlongbabu qiaofenghe duanyushihaoxiongdi " \
+    "yijieshusheng yidongburuyijing zhongguo nihao "
+/* engine threads, PY_SESSION_MAX sessions are shared by all of them */
+#define WORKERS_MAX 4
+
+static vector<Worker*> workers;
+static EngineConfig config;
 
 inline static int id(DimeClient* c)
 {
@@ -81,61 +94,214 @@ static gboolean on_commit(DimeClient* c, DimeMessage* msg)
     return 0;
 }
 
+static gboolean on_candidates(DimeClient* c, DimeMessage* msg)
+{
+    auto m = &msg->candidates;
+    dime_debug("C%d: page %d/%d: %s ...", id(c), m->page, m->page_count, 
+            m->n > 0 ? dime_mq_candidate(m, 0) : "");
+    return 0;
+}
+
 // server
-static int on_input(DimeServer* s, DimeMessage* msg)
+static gint64 elapsed_ms(gint64 since)
 {
-    //TODO: IM engine 
-    int key = msg->input.key;
-    if (key == '\n') {
-        dime_mq_server_send(s, msg->input.token, 0, MSG_COMMIT, EIM.StringGet, strlen(EIM.StringGet) + 1);
-    } else {
-        PY_DoInput(key);
-        dime_mq_server_send(s, msg->input.token, 0, MSG_PREEDIT, EIM.CodeInput, strlen(EIM.CodeInput) + 1);
+    return (g_get_monotonic_time() - since) / 1000;
+}
+
+/* decodes common syllables once so the first real keystroke does not pay
+ * for faulting in dictionaries and model pages */
+static void warmup(Engine* e)
+{
+    static const char* syllables[] = {
+        "de", "shi", "yi", "bu", "le", "zai", "ren", "you", "wo", "ta",
+        "zhe", "ge", "zhong", "guo", "nihao", "women", "shenme",
+    };
+
+    vector<const char*> words(e->page_size());
+    e->session(0);
+    for (auto py: syllables) {
+        for (const char* p = py; *p; p++) {
+            e->input(*p);
+        }
+        e->update();
+        e->page(0, words.data());
+        e->reset();
     }
+}
 
-    return 0;
+// runs on engine thread
+static void fill_page(Engine* engine, Job* job, int page)
+{
+    const char* words[DIME_CANDIDATES_MAX];
+    int n = engine->page(page, words);
+    job->candidates.assign(words, words + min(n, DIME_CANDIDATES_MAX));
+    job->page_count = engine->page_count();
 }
 
-static HMM load_hmm(const char* filepath)
+static void run_input(Worker* w, Job* job)
 {
-    HMM hmm;
+    Engine* engine = w->engine();
+    if (job->report) {
+        ostringstream os;
+        engine->report(os);
+        job->text = os.str();
+        return;
+    }
 
-    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE");
-    db.setDatabaseName(filepath);
-    if (!db.open()) {
-        qDebug() << db.lastError();
-        return hmm;
+    if (job->warmup) {
+        warmup(engine);
+        // the warmup decode is the first one to produce candidates
+        ostringstream os;
+        os << "warmup: " << elapsed_ms(job->started) << " ms, first candidate: " 
+            << elapsed_ms(started) << " ms after init" << endl;
+        auto resident = resident_prefaulted(config.lock);
+        if (resident > 0) {
+            os << "prefaulted: " << resident / 1024 << " KiB " 
+                << (config.lock ? "locked" : "resident") << endl;
+        }
+        job->text = os.str();
+        return;
     }
 
-    QSqlQuery qry("select character,probability from starting");
-    while (qry.next()) {
-        auto ch = qry.value(0).toString().toStdString();
-        auto prob = qry.value(1).toDouble();
+    if (job->release) {
+        engine->release(job->token);
+        return;
+    }
 
-        hmm.pi[ch] = (prob);
+    engine->session(job->token);
+    if (job->page >= 0) {
+        engine->update();
+        job->type = MSG_CANDIDATES;
+        fill_page(engine, job, job->page);
+        return;
     }
 
-    qry = QSqlQuery("select previous,behind,probability from transition");
-    //qry = QSqlQuery("select transition.previous, transition.behind, emission.pinyin, transition.probability + emission.probability as prob from transition inner join emission on transition.behind = emission.character");
-    while (qry.next()) {
-        auto s1 = qry.value(0).toString().toStdString();
-        auto s2 = qry.value(1).toString().toStdString();
-        auto prob = qry.value(2).toDouble();
+    // composition takes all keys, candidates are decoded once for them
+    for (auto key: job->keys) {
+        if (key == '\n') {
+            engine->update(); // catch up if decoding of stale keys was skipped
+            job->type = MSG_COMMIT;
+            const char* text = engine->select(0);
+            if (!text) engine->reset();
+            job->text = text ? text : "";
+            return;
+        }
+        engine->input(key);
+    }
 
-        hmm.a[s1][s2] = (prob);
+    if (!w->is_latest(job)) {
+        // a newer key of this client is queued, it'll decode for both
+        return;
     }
 
-    //qry = QSqlQuery("select character,pinyin,probability from emission");
-    qry = QSqlQuery("select emission.character, emission.pinyin, emission.probability + starting.probability from emission join starting on emission.character = starting.character");
-    while (qry.next()) {
-        auto s = qry.value(0).toString().toStdString();
-        auto py = qry.value(1).toString().toStdString();
-        auto prob = qry.value(2).toDouble();
+    engine->update();
+    job->type = MSG_PREEDIT;
+    job->text = engine->preedit();
+    job->page = 0;
+    fill_page(engine, job, 0);
+}
+
+static int write_text(char* buf, int len, gpointer data)
+{
+    const string* text = (const string*)data;
+    int n = text->size() + 1;
+    if (n > len) return -1;
 
-        hmm.emission[s][py] = (prob);
+    memcpy(buf, text->c_str(), n);
+    return n;
+}
+
+static void send_candidates(Job* job)
+{
+    vector<const char*> words;
+    for (auto& c: job->candidates) words.push_back(c.c_str());
+    dime_mq_server_send_candidates(s, job->token, max(job->page, 0), job->page_count, 
+            words.data(), words.size());
+}
+
+static void reply_input(Worker* w, Job* job)
+{
+    if (job->report) {
+        auto i = find(workers.begin(), workers.end(), w) - workers.begin();
+        cerr << "engine of worker " << i << ":" << endl << job->text;
+        return;
+    }
+
+    if (job->warmup) {
+        cerr << job->text;
+        return;
+    }
+
+    if (job->release) {
+        w->forget(job->token);
+        return;
+    }
+
+    // the reply of the latest key acks the skipped ones
+    if (job->type == MSG_INVALID) return;
+    if (job->type != MSG_COMMIT && !w->is_latest(job)) return;
+
+    if (job->type == MSG_CANDIDATES) {
+        send_candidates(job);
+        return;
     }
 
-    return hmm;
+    // page 0 goes along, a commit empties it
+    vector<const char*> words;
+    for (auto& c: job->candidates) words.push_back(c.c_str());
+    dime_mq_server_reply_input(s, job->token, job->ack, job->type, write_text, &job->text,
+            job->page_count, words.data(), words.size());
+}
+
+/* a token sticks to one worker, so its jobs run in order */
+static Worker* worker_of(uint32_t token)
+{
+    return workers[token % workers.size()];
+}
+
+static int on_page(DimeServer* s, DimeMessage* msg)
+{
+    Job* job = new Job;
+    job->token = msg->page.token;
+    job->page = msg->page.page;
+    job->received = g_get_monotonic_time();
+    worker_of(job->token)->push(job, false);
+    return 0;
+}
+
+/* jobs of the token still queued are stale behind it */
+static int on_release(DimeServer* s, DimeMessage* msg)
+{
+    Job* job = new Job;
+    job->token = msg->token.token;
+    job->release = true;
+    job->received = g_get_monotonic_time();
+    worker_of(job->token)->push(job);
+    return 0;
+}
+
+static int on_input(DimeServer* s, DimeMessage* msg)
+{
+    DimeMessageInputBatch* batch = &msg->input_batch;
+    auto now = g_get_monotonic_time();
+
+    // one job per commit, keys after it start the next one
+    Job* job = nullptr;
+    for (int i = 0; i < batch->count; i++) {
+        if (!job) {
+            job = new Job;
+            job->token = batch->token;
+            job->received = now;
+        }
+
+        job->keys.push_back(batch->keys[i]);
+        if (batch->keys[i] == '\n' || i == batch->count - 1) {
+            job->ack = batch->seq - (batch->count - 1 - i);
+            worker_of(job->token)->push(job);
+            job = nullptr;
+        }
+    }
+    return 0;
 }
 
 template<class T>
@@ -164,6 +330,147 @@ static vector<string> simple_pinyin_split(const string& py)
     return res;
 }
 
+static gboolean on_report(gpointer data)
+{
+    // an engine is only touched on its worker thread, the reports come 
+    // back as replies
+    for (auto w: workers) {
+        Job* job = new Job;
+        job->report = true;
+        job->received = g_get_monotonic_time();
+        w->push(job, false);
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        auto st = workers[i]->stats();
+        cerr << "worker " << i << ": " << st.jobs << " jobs, queued avg " 
+            << (st.jobs ? st.delay_total / (gint64)st.jobs : 0) << " us, max " 
+            << st.delay_max << " us, by 100us << n:";
+        for (int j = 0; j < WORKER_DELAY_HIST; j++) {
+            cerr << " " << st.delays[j];
+        }
+        cerr << endl;
+    }
+
+    DimeDrainStats st;
+    dime_mq_server_stats(s, &st);
+    cerr << "mq: " << st.messages << " messages in " << st.wakeups << " wakeups, max " 
+        << st.max_batch << ", capped " << st.capped << ", by batch:";
+    for (int i = 0; i < DIME_DRAIN_HIST; i++) {
+        cerr << " " << st.batches[i];
+    }
+    cerr << endl;
+
+    DimeSendStats sent;
+    dime_mq_server_send_stats(s, &sent);
+    cerr << "mq: " << sent.sent << " sent, " << sent.dropped << " dropped, " 
+        << sent.failed << " failed, " << sent.backlogged << " backlogged, " 
+        << sent.hung << " hung clients dropped, " << sent.queued << " bytes queued, " 
+        << sent.backlog << " in backlog" << endl;
+    return TRUE;
+}
+
+static long rss_kb()
+{
+    long pages = 0, rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) rss = 0;
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* replays the same keystrokes through every engine, a space commits */
+static void bench_engines(const char* keys)
+{
+    for (const auto& name: engine_names()) {
+        long rss = rss_kb();
+        auto now = g_get_monotonic_time();
+
+        Engine* e = create_engine(name.c_str());
+        if (!e->init(config)) {
+            cerr << name << ": init failed" << endl;
+            delete e;
+            continue;
+        }
+        auto init_ms = elapsed_ms(now);
+        now = g_get_monotonic_time();
+        if (config.prewarm) warmup(e);
+        auto warmup_ms = elapsed_ms(now);
+        rss = rss_kb() - rss;
+
+        vector<gint64> lat;
+        vector<const char*> words(e->page_size());
+        e->session(1);
+        for (const char* p = keys; *p; p++) {
+            auto t = g_get_monotonic_time();
+            if (*p == ' ') {
+                // reset instead of select, benchmarks should not train
+                e->update();
+                e->reset();
+            } else {
+                e->input(*p);
+                e->update();
+                e->page(0, words.data());
+            }
+            lat.push_back(g_get_monotonic_time() - t);
+        }
+
+        gint64 first = lat.empty() ? 0 : lat[0];
+        sort(lat.begin(), lat.end());
+        gint64 sum = 0;
+        for (auto l: lat) sum += l;
+
+        cerr << name << ": init " << init_ms << " ms, warmup " << warmup_ms << " ms, rss +" 
+            << rss << " KiB, engine " << e->memory() / 1024 << " KiB" << endl;
+        if (!lat.empty()) {
+            cerr << "  " << lat.size() << " keys, first " << first << " us, avg " << sum / (gint64)lat.size() 
+                << " us, p50 " << lat[lat.size() / 2] << " us, p99 " 
+                << lat[lat.size() * 99 / 100] << " us, max " << lat.back() << " us" << endl;
+        }
+
+        e->destroy();
+        delete e;
+    }
+}
+
+static int bench_hmm(HMM& hmm)
+{
+    const char* inputs[] = {
+        "tian'qi", "duan'yu", "gong'ju", "tian'long'ba'bu",
+        "qiao'feng'he'duan'yu'shi'hao'xiong'di", "hao'xiong'di",
+        "yi'jie'shu'sheng", "yi'dong'bu'ru'yi'jing",
+    };
+
+    auto now = g_get_monotonic_time();
+    for (auto py: inputs) {
+        dime::viterbi_decode(simple_pinyin_split(py), hmm);
+    }
+    cerr << "cost: " << elapsed_ms(now) << endl;
+
+    now = g_get_monotonic_time();
+    CompiledHMM<double> dm(hmm);
+    QuantizedHMM qm(hmm);
+    cerr << "compile: " << elapsed_ms(now) << endl;
+
+    auto report = memory_report(hmm);
+    report.compiled = dm.memory();
+    cerr << report << "quantized: " << qm.memory() / 1024 << " KiB" << endl;
+
+    now = g_get_monotonic_time();
+    for (auto py: inputs) {
+        cout << dm.decode(simple_pinyin_split(py)).str() << endl;
+    }
+    cerr << "compiled cost: " << elapsed_ms(now) << endl;
+
+    now = g_get_monotonic_time();
+    for (auto py: inputs) {
+        cout << qm.decode(simple_pinyin_split(py)).str() << endl;
+    }
+    cerr << "quantized cost: " << elapsed_ms(now) << endl;
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -171,12 +478,56 @@ int main(int argc, char *argv[])
 
     gchar *cmd = g_path_get_basename(argv[0]);
 
+    const gchar* engine_name = "pinyin";
+    gboolean bench = FALSE;
+    const gchar* keys = NULL;
+    const gchar* data_dir = g_getenv("DIME_PINYIN_DATADIR");
+    const gchar* user_dir = g_getenv("DIME_USER_DIR");
+    const gchar* hmm_db = g_getenv("DIME_HMM_DB");
+    gboolean no_prewarm = FALSE, lock = FALSE, no_history = FALSE;
+    gint n_workers = 2;
+    GOptionEntry entries[] = {
+        { "engine", 'e', 0, G_OPTION_ARG_STRING, &engine_name, "input engine: pinyin, hmm or hybrid", "NAME" },
+        { "bench", 'b', 0, G_OPTION_ARG_NONE, &bench, "replay keystrokes through every engine", NULL },
+        { "keys", 'k', 0, G_OPTION_ARG_STRING, &keys, "keystrokes for --bench, a space commits", "KEYS" },
+        { "data-dir", 0, 0, G_OPTION_ARG_FILENAME, &data_dir, "libpinyin system dictionaries", "DIR" },
+        { "user-dir", 0, 0, G_OPTION_ARG_FILENAME, &user_dir, "user dictionary and learning", "DIR" },
+        { "hmm", 0, 0, G_OPTION_ARG_FILENAME, &hmm_db, "sqlite database of the hmm engine", "FILE" },
+        { "no-prewarm", 0, 0, G_OPTION_ARG_NONE, &no_prewarm, "do not prefault dictionaries at startup", NULL },
+        { "mlock", 0, 0, G_OPTION_ARG_NONE, &lock, "keep the dictionary pages the warmup uses resident", NULL },
+        { "no-history", 0, 0, G_OPTION_ARG_NONE, &no_history, "do not rank candidates by past commits", NULL },
+        { "workers", 'w', 0, G_OPTION_ARG_INT, &n_workers, "engine threads, at most 4", "N" },
+        { NULL }
+    };
+
+    GError *err = NULL;
+    GOptionContext *opts = g_option_context_new(NULL);
+    g_option_context_add_main_entries(opts, entries, NULL);
+    if (!g_option_context_parse(opts, &argc, &argv, &err)) {
+        cerr << err->message << endl;
+        return -1;
+    }
+    g_option_context_free(opts);
+
+    config.data_dir = data_dir ? data_dir : DIME_PINYIN_DATADIR;
+    if (user_dir) {
+        config.user_dir = user_dir;
+    } else {
+        gchar* dir = g_build_filename(g_get_user_data_dir(), "dim", NULL);
+        config.user_dir = dir;
+        g_free(dir);
+    }
+    config.hmm_db = hmm_db ? hmm_db : DIME_HMM_DB;
+    config.prewarm = !no_prewarm;
+    config.lock = lock;
+
     GMainLoop *l = g_main_loop_new(NULL, TRUE);
 
     if (!g_str_equal(cmd, "dinput")) {
         DimeMessageCallbacks cbs = {
             .on_commit = on_commit,
-            .on_preedit = on_preedit
+            .on_preedit = on_preedit,
+            .on_candidates = on_candidates
         };
 
         {
@@ -192,29 +543,50 @@ int main(int argc, char *argv[])
         }
 
     } else {
-        QCoreApplication app(argc, argv);
-        auto now = QTime::currentTime();
-
-        auto hmm = load_hmm("/tmp/hmm.sqlite");
-        if (hmm.pi.size() == 0) return -1;
-        dime::viterbi(simple_pinyin_split("tian'qi"), hmm);
-        dime::viterbi(simple_pinyin_split("duan'yu"), hmm);
-        dime::viterbi(simple_pinyin_split("gong'ju"), hmm);
-        dime::viterbi(simple_pinyin_split("tian'long'ba'bu"), hmm);
-        dime::viterbi(simple_pinyin_split("qiao'feng'he'duan'yu'shi'hao'xiong'di"), hmm);
-        dime::viterbi(simple_pinyin_split("hao'xiong'di"), hmm);
-        dime::viterbi(simple_pinyin_split("yi'jie'shu'sheng"), hmm);
-        dime::viterbi(simple_pinyin_split("yi'dong'bu'ru'yi'jing"), hmm);
-        auto d = now.msecsTo(QTime::currentTime());
-        qDebug() << "cost: " << d;
-        return 0;
+        if (bench) {
+            auto now = g_get_monotonic_time();
+            auto hmm = load_hmm(config.hmm_db.c_str());
+            if (hmm.pi.size() > 0) {
+                compact(hmm);
+                cerr << "load: " << elapsed_ms(now) << endl;
+                bench_hmm(hmm);
+            }
+
+            bench_engines(keys ? keys : BENCH_KEYS);
+            return 0;
+        }
 
+        // one engine per worker, only the first one prefaults and warms up.
+        // the warmup runs on its worker, a session it selects is current on
+        // that thread only
+        n_workers = CLAMP(n_workers, 1, WORKERS_MAX);
+        EngineConfig cfg = config;
+        started = g_get_monotonic_time();
+        for (int i = 0; i < n_workers; i++) {
+            Engine* engine = create_engine(engine_name);
+            if (engine && !no_history) engine = with_history(engine);
+            if (!engine || !engine->init(cfg)) {
+                cerr << "can not start engine " << engine_name << endl;
+                return -1;
+            }
+
+            workers.push_back(new Worker(run_input, reply_input, engine));
+            if (i == 0 && cfg.prewarm) {
+                Job* job = new Job;
+                job->warmup = true;
+                job->received = g_get_monotonic_time();
+                workers[0]->push(job, false);
+            }
+            cfg.prewarm = false;
+        }
 
+        g_unix_signal_add(SIGUSR1, on_report, NULL);
         s = dime_mq_server_new();
-        PY_Init(0);
 
         DimeServerCallbacks cbs = {
-            .on_input = on_input
+            .on_input = on_input,
+            .on_page = on_page,
+            .on_release = on_release
         };
         dime_mq_server_set_callbacks(s, cbs);
 
@@ -223,6 +595,12 @@ int main(int argc, char *argv[])
     g_main_loop_run(l);
 
     if (g_str_equal(cmd, "dinput")) {
+        for (auto w: workers) {
+            Engine* engine = w->engine();
+            delete w;
+            engine->destroy();
+            delete engine;
+        }
         dime_mq_server_close(s);
 
     } else {
@@ -0,0 +1,48 @@
+#include "engine.h"
+
+#include <utility>
+
+namespace dime
+{
+
+static vector<pair<string, EngineFactory>>& _engines()
+{
+    static vector<pair<string, EngineFactory>> engines = {
+        {"pinyin", new_pinyin_engine},
+        {"hmm", new_hmm_engine},
+        {"hybrid", new_hybrid_engine},
+    };
+    return engines;
+}
+
+void register_engine(const char* name, EngineFactory factory)
+{
+    for (auto& e: _engines()) {
+        if (e.first == name) {
+            e.second = factory;
+            return;
+        }
+    }
+    _engines().emplace_back(name, factory);
+}
+
+Engine* create_engine(const char* name)
+{
+    for (const auto& e: _engines()) {
+        if (e.first == name) {
+            return e.second();
+        }
+    }
+    return nullptr;
+}
+
+vector<string> engine_names()
+{
+    vector<string> names;
+    for (const auto& e: _engines()) {
+        names.push_back(e.first);
+    }
+    return names;
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef _DIME_ENGINE_H
+#define _DIME_ENGINE_H 
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace dime
+{
+    using namespace std;
+
+    struct EngineConfig {
+        string data_dir; /* system dictionaries */
+        string user_dir; /* user learning */
+        string hmm_db;
+        bool prewarm; /* prefault dictionaries at init */
+        bool lock; /* keep the dictionary pages a warmup uses resident (mlock) */
+    };
+
+    /* an input method backend. all calls come from one thread (the engine
+     * worker), strings returned are owned by the engine and keep valid 
+     * until the next call. engines of other workers may run at the same
+     * time, they share dictionaries and models but not sessions. */
+    class Engine {
+    public:
+        virtual ~Engine() {}
+
+        virtual const char* name() const = 0;
+        virtual bool init(const EngineConfig& cfg) = 0;
+        virtual void destroy() = 0;
+
+        /* switch to the composition of an input context */
+        virtual void session(uint32_t token) = 0;
+        /* the input context is gone, its composition can be dropped */
+        virtual void release(uint32_t token) {}
+
+        /* updates composition only */
+        virtual void input(int key) = 0;
+        /* brings candidates up to date with composition, cheap if nothing 
+         * changed since last call */
+        virtual void update() = 0;
+
+        virtual const char* preedit() = 0;
+        virtual int page_size() = 0;
+        virtual int page_count() = 0;
+        /* fills words with up to page_size() candidates, returns count */
+        virtual int page(int n, const char** words) = 0;
+
+        /* commits candidate index and starts a new composition, returns the
+         * committed text, or nullptr if there is no such candidate */
+        virtual const char* select(int index) = 0;
+        virtual void reset() = 0;
+
+        /* bytes owned by the engine if known, 0 otherwise */
+        virtual size_t memory() const { return 0; }
+        virtual void report(ostream& os) const {}
+    };
+
+    using EngineFactory = Engine* (*)();
+
+    void register_engine(const char* name, EngineFactory factory);
+    /* returns nullptr for unknown names, engine still needs init() */
+    Engine* create_engine(const char* name);
+    vector<string> engine_names();
+
+    Engine* new_pinyin_engine();
+    Engine* new_hmm_engine();
+    /* pinyin and hmm candidates merged into one list */
+    Engine* new_hybrid_engine();
+
+    /* learns committed phrases and moves the frequent ones to the front of
+     * the first page. takes ownership of inner. */
+    Engine* with_history(Engine* inner);
+}
+
+#endif /* ifndef _DIME_ENGINE_H */
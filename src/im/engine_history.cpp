@@ -0,0 +1,148 @@
+#include "engine.h"
+#include "history.h"
+
+#include <glib.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dime
+{
+
+#define HISTORY_FILE "commits.lfu"
+
+/* engines of different threads learn into the same history */
+static shared_ptr<CommitHistory> _open_history(const string& path)
+{
+    static mutex lock;
+    static map<string, weak_ptr<CommitHistory>> histories;
+
+    lock_guard<mutex> l(lock);
+    auto history = histories[path].lock();
+    if (!history) {
+        history = make_shared<CommitHistory>();
+        if (!history->open(path.c_str())) {
+            cerr << "commit history disabled" << endl;
+        }
+        histories[path] = history;
+    }
+    return history;
+}
+
+/* puts what the user commits often first on the first page. only the
+ * first page is re-ranked, so it costs page_size() lookups per page and
+ * candidate indexes below page_size() are translated back on select. */
+class HistoryEngine: public Engine {
+public:
+    explicit HistoryEngine(Engine* inner): _inner(inner) {}
+
+    const char* name() const override { return _inner->name(); }
+
+    bool init(const EngineConfig& cfg) override
+    {
+        gchar* path = g_build_filename(cfg.user_dir.c_str(), HISTORY_FILE, NULL);
+        g_mkdir_with_parents(cfg.user_dir.c_str(), 0700);
+        _history = _open_history(path);
+        g_free(path);
+
+        return _inner->init(cfg);
+    }
+
+    void destroy() override
+    {
+        _inner->destroy();
+        _history.reset();
+    }
+
+    void session(uint32_t token) override { _inner->session(token); }
+    void release(uint32_t token) override { _inner->release(token); }
+    void input(int key) override { _inner->input(key); }
+    void update() override { _inner->update(); }
+
+    const char* preedit() override { return _inner->preedit(); }
+    int page_size() override { return _inner->page_size(); }
+    int page_count() override { return _inner->page_count(); }
+
+    int page(int n, const char** words) override
+    {
+        if (n != 0) return _inner->page(n, words);
+
+        int count = _rank();
+        for (int i = 0; i < count; i++) {
+            words[i] = _words[_order[i]];
+        }
+        return count;
+    }
+
+    const char* select(int index) override
+    {
+        if (index >= 0 && index < page_size() && index < _rank()) {
+            index = _order[index];
+        }
+
+        const char* text = _inner->select(index);
+        if (text) _history->commit(text);
+        return text;
+    }
+
+    void reset() override { _inner->reset(); }
+
+    size_t memory() const override
+    {
+        return _inner->memory() + (_history ? _history->memory() : 0);
+    }
+
+    void report(ostream& os) const override
+    {
+        _inner->report(os);
+        if (_history) {
+            os << "history: " << _history->size() << " phrases, "
+                << _history->memory() / 1024 << " KiB mapped" << endl;
+        }
+    }
+
+private:
+    /* orders the first page by commit count, ties keep the engine's order */
+    int _rank();
+
+    unique_ptr<Engine> _inner;
+    shared_ptr<CommitHistory> _history; /* shared by engines of one user dir */
+
+    vector<const char*> _words;
+    vector<uint32_t> _counts;
+    vector<int> _order;
+};
+
+int HistoryEngine::_rank()
+{
+    size_t size = page_size();
+    _words.resize(size);
+    _counts.resize(size);
+    _order.resize(size);
+
+    int n = _inner->page(0, _words.data());
+    for (int i = 0; i < n; i++) {
+        _counts[i] = _history->count(_words[i]);
+        _order[i] = i;
+    }
+
+    // insertion sort is stable and the page is short
+    for (int i = 1; i < n; i++) {
+        int k = _order[i];
+        int j = i;
+        for (; j > 0 && _counts[_order[j-1]] < _counts[k]; j--) {
+            _order[j] = _order[j-1];
+        }
+        _order[j] = k;
+    }
+    return n;
+}
+
+Engine* with_history(Engine* inner)
+{
+    return inner ? new HistoryEngine(inner) : nullptr;
+}
+
+}
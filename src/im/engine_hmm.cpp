@@ -0,0 +1,247 @@
+#include "engine.h"
+#include "hmm.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace dime
+{
+
+#define HMM_SESSION_MAX 8
+#define HMM_SYLLABLE_MAX 6
+#define HMM_PAGE_SIZE 10
+
+/* sentence decoding with the compiled HMM. the first candidate is the 
+ * decoded sentence, the rest are characters of the first syllable ordered 
+ * by their initial score. */
+class HmmEngine: public Engine {
+public:
+
+    const char* name() const override { return "hmm"; }
+
+    bool init(const EngineConfig& cfg) override;
+    void destroy() override;
+
+    void session(uint32_t token) override;
+    void release(uint32_t token) override;
+
+    void input(int key) override;
+    void update() override;
+
+    const char* preedit() override { return _cur->input.c_str(); }
+    int page_size() override { return HMM_PAGE_SIZE; }
+    int page_count() override;
+    int page(int n, const char** words) override;
+
+    const char* select(int index) override;
+    void reset() override;
+
+    size_t memory() const override { return _model ? _model->memory() : 0; }
+    void report(ostream& os) const override;
+
+private:
+    struct Composition {
+        string input;
+        bool dirty;
+        string sentence;
+        vector<const string*> chars;
+        uint64_t last_used;
+    };
+
+    const char* _word(int index) const;
+    bool _split(const string& input, vector<string>& py) const;
+
+    shared_ptr<const CompiledHMM<double>> _model; /* shared by engines of one db */
+    MemoryReport _tables; /* of the model as loaded, before compiling */
+
+    unordered_map<uint32_t, Composition> _sessions;
+    Composition* _cur = nullptr;
+    uint64_t _tick = 0;
+    string _committed;
+};
+
+/* the model is read only once compiled, engines of different threads use
+ * the same one. report is what its tables took before compiling */
+static shared_ptr<const CompiledHMM<double>> _load_model(const string& db, MemoryReport& report)
+{
+    static mutex lock;
+    static map<string, weak_ptr<const CompiledHMM<double>>> models;
+    static map<string, MemoryReport> reports;
+
+    lock_guard<mutex> l(lock);
+    auto model = models[db].lock();
+    if (!model) {
+        auto hmm = load_hmm(db.c_str());
+        if (hmm.pi.empty()) return nullptr;
+
+        compact(hmm);
+        reports[db] = memory_report(hmm);
+        model = make_shared<const CompiledHMM<double>>(hmm);
+        reports[db].compiled = model->memory();
+        models[db] = model;
+    }
+    report = reports[db];
+    return model;
+}
+
+bool HmmEngine::init(const EngineConfig& cfg)
+{
+    _model = _load_model(cfg.hmm_db, _tables);
+    if (!_model) return false;
+
+    session(0);
+    return true;
+}
+
+void HmmEngine::destroy()
+{
+    _sessions.clear();
+    _cur = nullptr;
+    _model.reset();
+}
+
+void HmmEngine::session(uint32_t token)
+{
+    auto i = _sessions.find(token);
+    if (i == _sessions.end()) {
+        if (_sessions.size() >= HMM_SESSION_MAX) {
+            auto lru = min_element(_sessions.begin(), _sessions.end(), 
+                    [](const pair<const uint32_t, Composition>& a, 
+                        const pair<const uint32_t, Composition>& b) {
+                        return a.second.last_used < b.second.last_used;
+                    });
+            _sessions.erase(lru);
+        }
+        i = _sessions.emplace(token, Composition{"", false, "", {}, 0}).first;
+    }
+
+    _cur = &i->second;
+    _cur->last_used = ++_tick;
+}
+
+void HmmEngine::release(uint32_t token)
+{
+    auto i = _sessions.find(token);
+    if (i == _sessions.end()) return;
+
+    // the current one stays until another is selected, it is the first to go
+    if (&i->second == _cur) {
+        *_cur = Composition{"", false, "", {}, 0};
+    } else {
+        _sessions.erase(i);
+    }
+}
+
+void HmmEngine::input(int key)
+{
+    if ((key >= 'a' && key <= 'z') || key == '\'') {
+        _cur->input.push_back(key);
+        _cur->dirty = true;
+    }
+}
+
+/* greedy longest match against known syllables, ' forces a boundary */
+bool HmmEngine::_split(const string& input, vector<string>& py) const
+{
+    py.clear();
+    size_t i = 0;
+    while (i < input.size()) {
+        if (input[i] == '\'') {
+            i++;
+            continue;
+        }
+
+        size_t n = min((size_t)HMM_SYLLABLE_MAX, input.size() - i);
+        for (; n > 0; n--) {
+            if (input.find('\'', i) < i + n) continue;
+            if (_model->known(input.substr(i, n))) break;
+        }
+        if (n == 0) return false;
+
+        py.push_back(input.substr(i, n));
+        i += n;
+    }
+    return !py.empty();
+}
+
+void HmmEngine::update()
+{
+    if (!_cur->dirty) return;
+    _cur->dirty = false;
+    _cur->sentence.clear();
+    _cur->chars.clear();
+
+    vector<string> py;
+    if (!_split(_cur->input, py)) return;
+
+    _cur->sentence = _model->decode(py).str();
+
+    vector<uint32_t> ids;
+    _model->lookup({py[0]}, ids);
+    auto emitters = _model->emitters(ids[0]);
+    sort(emitters.begin(), emitters.end(), [](const Emitter<uint32_t, double>& a, 
+                const Emitter<uint32_t, double>& b) { return a.start > b.start; });
+    for (const auto& e: emitters) {
+        _cur->chars.push_back(&_model->name(e.state));
+    }
+}
+
+const char* HmmEngine::_word(int index) const
+{
+    if (index < 0) return nullptr;
+
+    bool has_sentence = !_cur->sentence.empty();
+    if (has_sentence && index == 0) return _cur->sentence.c_str();
+
+    size_t i = index - has_sentence;
+    return i < _cur->chars.size() ? _cur->chars[i]->c_str() : nullptr;
+}
+
+int HmmEngine::page_count()
+{
+    size_t n = _cur->chars.size() + !_cur->sentence.empty();
+    return (n + HMM_PAGE_SIZE - 1) / HMM_PAGE_SIZE;
+}
+
+int HmmEngine::page(int n, const char** words)
+{
+    int count = 0;
+    for (; count < HMM_PAGE_SIZE; count++) {
+        if ((words[count] = _word(n * HMM_PAGE_SIZE + count)) == nullptr) break;
+    }
+    return count;
+}
+
+const char* HmmEngine::select(int index)
+{
+    const char* w = _word(index);
+    _committed = w ? w : "";
+    reset();
+    return w ? _committed.c_str() : nullptr;
+}
+
+void HmmEngine::reset()
+{
+    _cur->input.clear();
+    _cur->sentence.clear();
+    _cur->chars.clear();
+    _cur->dirty = false;
+}
+
+void HmmEngine::report(ostream& os) const
+{
+    os << "hmm: " << (_model ? _model->n_states() : 0) << " states, " 
+        << memory() / 1024 << " KiB" << endl;
+    if (_model) os << _tables;
+}
+
+Engine* new_hmm_engine()
+{
+    return new HmmEngine;
+}
+
+}
@@ -0,0 +1,345 @@
+#include "engine.h"
+
+#include <glib.h>
+
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_set>
+
+namespace dime
+{
+
+#define HYBRID_BUDGET_US 3000
+
+/* one list out of the candidates of several engines. the first engine is
+ * the primary one, it owns the preedit.
+ *
+ * engines are asked for their pages lazily and merged k-way on a heap.
+ * engines do not share a score scale, so a candidate scores
+ * weight / (rank + 1) in its own engine, which keeps every stream sorted.
+ * repeated strings are dropped, the first engine to offer one keeps it.
+ * merging stops when the page is full or the time budget runs out, then
+ * a short page is returned and the next call goes on from there.
+ *
+ * the other engines decode on a helper thread while the primary one
+ * decodes on the calling thread, so update() costs as much as the slowest
+ * engine, not their sum. */
+class HybridEngine: public Engine {
+public:
+    HybridEngine();
+
+    const char* name() const override { return "hybrid"; }
+
+    bool init(const EngineConfig& cfg) override;
+    void destroy() override;
+
+    void session(uint32_t token) override;
+    void release(uint32_t token) override;
+    void input(int key) override;
+    void update() override;
+
+    const char* preedit() override { return _streams[0].engine->preedit(); }
+    int page_size() override { return _streams[0].engine->page_size(); }
+    /* an upper bound, repeated candidates are not known in advance */
+    int page_count() override;
+    int page(int n, const char** words) override;
+
+    const char* select(int index) override;
+    void reset() override;
+
+    size_t memory() const override;
+    void report(ostream& os) const override;
+
+private:
+    struct Stream {
+        unique_ptr<Engine> engine;
+        double weight;
+
+        vector<const char*> words; /* current page of the engine */
+        int page;
+        int pos;
+        int n;
+    };
+
+    struct Merged {
+        string text;
+        int stream;
+        int index; /* in its engine */
+    };
+
+    using Head = pair<double, int>; /* score, stream */
+    struct Lower {
+        bool operator()(const Head& a, const Head& b) const
+        {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        }
+    };
+
+    void _restart();
+    bool _next(Stream& s);
+    void _push(int stream);
+    bool _merge(size_t until, bool timed = true);
+
+    void _helper();
+
+    vector<Stream> _streams;
+
+    vector<Merged> _merged;
+    unordered_set<string> _seen;
+    priority_queue<Head, vector<Head>, Lower> _heap;
+    bool _stale = true;
+
+    thread _thread;
+    mutex _lock;
+    condition_variable _cond;
+    int _pending = 0; /* decodes queued to the helper */
+    bool _quit = false;
+};
+
+HybridEngine::HybridEngine()
+{
+    Stream s = {};
+    s.weight = 1.0;
+
+    s.engine.reset(new_pinyin_engine());
+    _streams.push_back(move(s));
+
+    s.engine.reset(new_hmm_engine());
+    _streams.push_back(move(s));
+}
+
+bool HybridEngine::init(const EngineConfig& cfg)
+{
+    if (!_streams[0].engine->init(cfg)) {
+        return false;
+    }
+
+    for (auto s = _streams.begin() + 1; s != _streams.end();) {
+        if (!s->engine->init(cfg)) {
+            cerr << "hybrid: going on without " << s->engine->name() << endl;
+            s = _streams.erase(s);
+        } else {
+            ++s;
+        }
+    }
+
+    if (_streams.size() > 1) {
+        _thread = thread(&HybridEngine::_helper, this);
+    }
+    return true;
+}
+
+void HybridEngine::destroy()
+{
+    if (_thread.joinable()) {
+        {
+            lock_guard<mutex> l(_lock);
+            _quit = true;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+
+    for (auto& s: _streams) {
+        s.engine->destroy();
+    }
+}
+
+void HybridEngine::_helper()
+{
+    unique_lock<mutex> l(_lock);
+    for (;;) {
+        _cond.wait(l, [this] { return _quit || _pending; });
+        if (_quit) break;
+
+        l.unlock();
+        for (size_t i = 1; i < _streams.size(); i++) {
+            _streams[i].engine->update();
+        }
+        l.lock();
+
+        _pending = 0;
+        _cond.notify_all();
+    }
+}
+
+void HybridEngine::session(uint32_t token)
+{
+    for (auto& s: _streams) {
+        s.engine->session(token);
+    }
+    _stale = true;
+}
+
+void HybridEngine::release(uint32_t token)
+{
+    for (auto& s: _streams) {
+        s.engine->release(token);
+    }
+}
+
+void HybridEngine::input(int key)
+{
+    for (auto& s: _streams) {
+        s.engine->input(key);
+    }
+    _stale = true;
+}
+
+void HybridEngine::update()
+{
+    if (_thread.joinable()) {
+        lock_guard<mutex> l(_lock);
+        _pending = 1;
+    }
+    _cond.notify_all();
+
+    _streams[0].engine->update();
+
+    if (_thread.joinable()) {
+        unique_lock<mutex> l(_lock);
+        _cond.wait(l, [this] { return !_pending; });
+    }
+    _stale = true;
+}
+
+void HybridEngine::_restart()
+{
+    _merged.clear();
+    _seen.clear();
+    _heap = decltype(_heap)();
+
+    for (size_t i = 0; i < _streams.size(); i++) {
+        auto& s = _streams[i];
+        s.words.resize(s.engine->page_size());
+        s.page = -1;
+        s.pos = s.n = 0;
+        _push(i);
+    }
+    _stale = false;
+}
+
+/* moves the stream to its next candidate, fetching a page if needed */
+bool HybridEngine::_next(Stream& s)
+{
+    if (s.pos + 1 < s.n) {
+        s.pos++;
+        return true;
+    }
+
+    if (s.page >= 0 && s.n < (int)s.words.size()) return false;
+    if (s.page + 1 >= s.engine->page_count()) return false;
+
+    s.n = s.engine->page(++s.page, s.words.data());
+    s.pos = 0;
+    return s.n > 0;
+}
+
+void HybridEngine::_push(int stream)
+{
+    auto& s = _streams[stream];
+    if (!_next(s)) return;
+
+    int rank = s.page * s.words.size() + s.pos;
+    _heap.push(Head(s.weight / (rank + 1), stream));
+}
+
+/* merges until there are until candidates, returns false if the time ran
+ * out first. untimed merges stop only when the streams run dry */
+bool HybridEngine::_merge(size_t until, bool timed)
+{
+    if (_stale) _restart();
+
+    auto deadline = g_get_monotonic_time() + HYBRID_BUDGET_US;
+    while (_merged.size() < until && !_heap.empty()) {
+        int i = _heap.top().second;
+        _heap.pop();
+
+        auto& s = _streams[i];
+        const char* w = s.words[s.pos];
+        if (w && _seen.insert(w).second) {
+            _merged.push_back(Merged{w, i, (int)(s.page * s.words.size()) + s.pos});
+        }
+        _push(i);
+
+        if (timed && g_get_monotonic_time() > deadline) return false;
+    }
+    return true;
+}
+
+int HybridEngine::page_count()
+{
+    int n = 0;
+    for (auto& s: _streams) {
+        n += s.engine->page_count();
+    }
+    return n;
+}
+
+int HybridEngine::page(int n, const char** words)
+{
+    size_t size = page_size();
+    size_t start = n * size;
+    if (!_merge(start + size) && _merged.size() <= start) {
+        // out of time before this page got anything, try once more
+        _merge(start + 1);
+    }
+
+    int count = 0;
+    for (size_t i = start; i < _merged.size() && i < start + size; i++) {
+        words[count++] = _merged[i].text.c_str();
+    }
+    return count;
+}
+
+const char* HybridEngine::select(int index)
+{
+    // index is into the merged list, it has to get there whatever it takes
+    if (index < 0 || !_merge(index + 1, false) || (size_t)index >= _merged.size()) {
+        return nullptr;
+    }
+
+    // the engine selected from learns, the others just start over
+    const Merged& m = _merged[index];
+    for (size_t i = 0; i < _streams.size(); i++) {
+        if ((int)i != m.stream) _streams[i].engine->reset();
+    }
+
+    _stale = true;
+    return _streams[m.stream].engine->select(m.index);
+}
+
+void HybridEngine::reset()
+{
+    for (auto& s: _streams) {
+        s.engine->reset();
+    }
+    _stale = true;
+}
+
+size_t HybridEngine::memory() const
+{
+    size_t n = 0;
+    for (const auto& s: _streams) {
+        n += s.engine->memory();
+    }
+    return n;
+}
+
+void HybridEngine::report(ostream& os) const
+{
+    for (const auto& s: _streams) {
+        s.engine->report(os);
+    }
+}
+
+Engine* new_hybrid_engine()
+{
+    return new HybridEngine;
+}
+
+}
@@ -0,0 +1,62 @@
+#include "engine.h"
+#include "py.h"
+#include "prewarm.h"
+
+#include <glib.h>
+#include <iostream>
+
+namespace dime
+{
+
+/* libpinyin through the PY_* interface */
+class PinyinEngine: public Engine {
+public:
+    const char* name() const override { return "pinyin"; }
+
+    bool init(const EngineConfig& cfg) override
+    {
+        if (cfg.prewarm) {
+            auto n = prefault_dir(cfg.data_dir.c_str(), cfg.lock);
+            cerr << "pinyin: mapped " << n / 1024 << " KiB, " 
+                << (cfg.lock ? "locking what the warmup uses" : "reading ahead") << endl;
+        }
+
+        g_mkdir_with_parents(cfg.user_dir.c_str(), 0700);
+        return PY_Init(cfg.data_dir.c_str(), cfg.user_dir.c_str()) == 0;
+    }
+
+    void destroy() override
+    {
+        PY_Destroy();
+        release_prefaulted();
+    }
+
+    void session(uint32_t token) override { PY_SelectSession(token); }
+    void release(uint32_t token) override { PY_ReleaseSession(token); }
+
+    void input(int key) override { PY_PushKey(key); }
+    void update() override { PY_GetCandWords(0); }
+
+    const char* preedit() override { return EIM.CodeInput; }
+    int page_size() override { return EIM.CandWordMax; }
+    int page_count() override { return EIM.CandPageCount; }
+    int page(int n, const char** words) override { return PY_GetCandPage(n, words); }
+
+    const char* select(int index) override
+    {
+        // PY_Commit would commit whatever was committed last
+        if (!PY_GetCandWord(index)) return nullptr;
+
+        PY_Commit(index);
+        return EIM.StringGet;
+    }
+
+    void reset() override { PY_Reset(); }
+};
+
+Engine* new_pinyin_engine()
+{
+    return new PinyinEngine;
+}
+
+}
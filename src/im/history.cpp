@@ -0,0 +1,182 @@
+#include "history.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <iostream>
+
+using namespace std;
+
+namespace dime
+{
+
+#define HISTORY_MAGIC 0x55464c44 /* DLFU */
+#define HISTORY_VERSION 1
+#define HISTORY_CAPACITY 4096 /* power of 2 */
+#define HISTORY_PROBE 8
+#define HISTORY_DECAY 1024
+#define HISTORY_TEXT 55
+
+struct CommitHistory::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t commits;
+    uint16_t epoch;
+    uint8_t reserved[46];
+};
+
+/* one cache line */
+struct CommitHistory::Entry {
+    uint32_t hash;
+    uint16_t count;
+    uint16_t epoch;
+    uint8_t len; /* 0 for a free slot */
+    char text[HISTORY_TEXT];
+};
+
+/* FNV-1a */
+static uint32_t _hash(const char* s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+bool CommitHistory::open(const char* path)
+{
+    static_assert(sizeof(Header) == 64, "history header layout");
+    static_assert(sizeof(Entry) == 64, "history entry layout");
+
+    close();
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        cerr << "open " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    size_t size = sizeof(Header) + HISTORY_CAPACITY * sizeof(Entry);
+    struct stat st;
+    bool fresh = fstat(fd, &st) < 0 || (size_t)st.st_size != size;
+    if (fresh && ftruncate(fd, 0) < 0) fresh = false;
+    if (ftruncate(fd, size) < 0) {
+        cerr << "resize " << path << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        cerr << "mmap " << path << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    _header = (Header*)p;
+    _entries = (Entry*)(_header + 1);
+    _size = size;
+
+    if (fresh || _header->magic != HISTORY_MAGIC || _header->version != HISTORY_VERSION ||
+            _header->capacity != HISTORY_CAPACITY) {
+        memset(p, 0, size);
+        _header->magic = HISTORY_MAGIC;
+        _header->version = HISTORY_VERSION;
+        _header->capacity = HISTORY_CAPACITY;
+    }
+    return true;
+}
+
+void CommitHistory::close()
+{
+    if (!_header) return;
+
+    msync(_header, _size, MS_ASYNC);
+    munmap(_header, _size);
+    _header = nullptr;
+    _entries = nullptr;
+    _size = 0;
+}
+
+uint32_t CommitHistory::_decayed(const Entry* e) const
+{
+    uint16_t age = _header->epoch - e->epoch;
+    return age >= 16 ? 0 : e->count >> age;
+}
+
+CommitHistory::Entry* CommitHistory::_find(uint32_t hash, const char* text, size_t len) const
+{
+    for (int i = 0; i < HISTORY_PROBE; i++) {
+        Entry* e = &_entries[(hash + i) & (HISTORY_CAPACITY - 1)];
+        if (e->len == len && e->hash == hash && memcmp(e->text, text, len) == 0) {
+            return e;
+        }
+    }
+    return nullptr;
+}
+
+void CommitHistory::commit(const char* text)
+{
+    size_t len = text ? strlen(text) : 0;
+    if (!_header || len == 0 || len > HISTORY_TEXT) return;
+
+    lock_guard<mutex> l(_lock);
+    if (++_header->commits % HISTORY_DECAY == 0) {
+        _header->epoch++;
+    }
+
+    uint32_t hash = _hash(text, len);
+    Entry* e = _find(hash, text, len);
+    if (e) {
+        uint32_t n = _decayed(e) + 1;
+        e->count = n > UINT16_MAX ? UINT16_MAX : n;
+        e->epoch = _header->epoch;
+        return;
+    }
+
+    // a free slot, or else the one least worth keeping
+    Entry* victim = nullptr;
+    uint32_t min = UINT32_MAX;
+    for (int i = 0; i < HISTORY_PROBE; i++) {
+        Entry* s = &_entries[(hash + i) & (HISTORY_CAPACITY - 1)];
+        uint32_t n = s->len ? _decayed(s) : 0;
+        if (n < min) {
+            min = n;
+            victim = s;
+            if (n == 0) break;
+        }
+    }
+
+    victim->hash = hash;
+    victim->count = 1;
+    victim->epoch = _header->epoch;
+    victim->len = len;
+    memcpy(victim->text, text, len);
+}
+
+uint32_t CommitHistory::count(const char* text) const
+{
+    size_t len = text ? strlen(text) : 0;
+    if (!_header || len == 0 || len > HISTORY_TEXT) return 0;
+
+    lock_guard<mutex> l(_lock);
+    const Entry* e = _find(_hash(text, len), text, len);
+    return e ? _decayed(e) : 0;
+}
+
+size_t CommitHistory::size() const
+{
+    size_t n = 0;
+    for (size_t i = 0; _header && i < HISTORY_CAPACITY; i++) {
+        if (_entries[i].len && _decayed(&_entries[i])) n++;
+    }
+    return n;
+}
+
+}
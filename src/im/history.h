@@ -0,0 +1,56 @@
+#ifndef _DIME_HISTORY_H
+#define _DIME_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+namespace dime
+{
+    /* frequencies of committed phrases, a fixed size open addressing table
+     * mapped from a file so it persists without ever being written out on
+     * the input path.
+     *
+     * lookups and updates probe at most HISTORY_PROBE slots. when they are
+     * all taken the least frequent one is replaced. counts halve every
+     * HISTORY_DECAY commits, lazily: each entry remembers the epoch it was
+     * last touched in and is aged when it is read.
+     *
+     * commit and count can be called from several threads. */
+    class CommitHistory {
+    public:
+        CommitHistory() {}
+        ~CommitHistory() { close(); }
+
+        /* maps path, creates or resets it if it is missing or not a
+         * history file */
+        bool open(const char* path);
+        void close();
+        bool is_open() const { return _header != nullptr; }
+
+        void commit(const char* text);
+        /* decayed count of text, 0 if it was never committed */
+        uint32_t count(const char* text) const;
+
+        size_t size() const;
+        size_t memory() const { return _size; }
+
+    private:
+        struct Header;
+        struct Entry;
+
+        Entry* _find(uint32_t hash, const char* text, size_t len) const;
+        uint32_t _decayed(const Entry* e) const;
+
+        mutable std::mutex _lock;
+        Header* _header = nullptr;
+        Entry* _entries = nullptr;
+        size_t _size = 0;
+
+        CommitHistory(const CommitHistory&) = delete;
+        CommitHistory& operator=(const CommitHistory&) = delete;
+    };
+}
+
+#endif /* ifndef _DIME_HISTORY_H */
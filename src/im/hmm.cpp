@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 
@@ -31,93 +33,204 @@ ostream& operator<<(ostream& os, const unordered_map<K, V>& m)
     return os << "}";
 }
 
-static vector<string> _hmm_get_zi(HMM& hmm, const string& py)
+HMMModel::HMMModel(const HMM& hmm, const vector<string>* obs)
+    :_hmm(hmm)
 {
-    vector<string> res;
+    if (obs) {
+        for (const auto& o: *obs) {
+            _by_obs[o];
+        }
+    }
+
     for (const auto& p: hmm.emission) {
-        if (p.second.find(py) != p.second.end()) {
-            res.push_back(p.first);
+        auto pi = hmm.pi.find(p.first);
+        double start = pi != hmm.pi.end() ? pi->second : 0.0;
+
+        for (const auto& e: p.second) {
+            auto i = obs ? _by_obs.find(e.first) : _by_obs.emplace(e.first, 
+                    vector<Emitter<State, Score>>()).first;
+            if (i == _by_obs.end()) continue;
+
+            i->second.push_back({&p.first, start + e.second, e.second});
         }
     }
+}
 
-    return res;
+const vector<Emitter<HMMModel::State, HMMModel::Score>>& HMMModel::emitters(const Obs& o) const
+{
+    static const vector<Emitter<State, Score>> none;
+    auto i = _by_obs.find(o);
+    return i != _by_obs.end() ? i->second : none;
 }
 
-// HMM: initial probabilities, transfer matrix, emission matrix,
-// output probabilities
-vector<string> viterbi(const vector<string>& obs, HMM& hmm)
+bool HMMModel::trans(State from, State to, Score& s) const
 {
-    auto st = _hmm_get_zi(hmm, obs[0]);
-    int n_states = st.size();
-    int n_seq = obs.size();
+    auto r = _hmm.a.find(*from);
+    if (r == _hmm.a.end()) return false;
 
-    if (n_states == 0 || n_seq == 0) return {};
+    auto c = r->second.find(*to);
+    if (c == r->second.end()) return false;
 
+    s = c->second;
+    return true;
+}
 
-    auto res = vector<string>(n_seq);
-    auto v = unordered_map<int, unordered_map<int, double>>();
-    auto parents = unordered_map<int, unordered_map<int, int>>();
+template<class S>
+CompiledHMM<S>::CompiledHMM(const HMM& hmm)
+{
+    using Traits = ScoreTraits<S>;
 
-    for (auto i = 0; i < n_states; i++) {
-        if (hmm.emission[st[i]].count(obs[0])) {
-            v[0][i] =  hmm.pi[st[i]] + hmm.emission[st[i]][obs[0]];
-        } else {
-            v[0][i] = -1000.0;
-        }
+    // only states which emit something can ever be decoded
+    unordered_map<string, State> ids;
+    ids.reserve(hmm.emission.size());
+    _names.reserve(hmm.emission.size());
+    for (const auto& p: hmm.emission) {
+        ids.emplace(p.first, _names.size());
+        _names.push_back(p.first);
     }
 
-    cout << "0: " << st << endl;
-
-    for (auto i = 1; i < n_seq; i++) {
-        auto st_next = _hmm_get_zi(hmm, obs[i]); 
-        auto n_states_next = st_next.size();
-        for (auto j = 0; j < n_states_next; j++) {
+    for (const auto& p: hmm.emission) {
+        State s = ids[p.first];
+        auto pi = hmm.pi.find(p.first);
+        double start = pi != hmm.pi.end() ? pi->second : 0.0;
 
-            double max = -1000.0;
-            int parent = 0;
-            for (auto l = 0; l < n_states; l++) {
-                assert(hmm.emission[st_next[j]].count(obs[i]));
-                if (hmm.a.count(st[l]) == 0 || hmm.a[st[l]].count(st_next[j]) == 0) {
-                    continue;
-                }
+        for (const auto& e: p.second) {
+            auto o = _obs_ids.emplace(e.first, _emitters.size());
+            if (o.second) {
+                _emitters.emplace_back();
+            }
+            _emitters[o.first->second].push_back({s, Traits::from(start + e.second),
+                    Traits::from(e.second)});
+        }
+    }
 
-                //assert(v[i-1][l] != 0.0 && v[i-1][l] > -1000.0);
-                auto m = v[i-1][l] + hmm.a[st[l]][st_next[j]] + hmm.emission[st_next[j]][obs[i]];
-                if (m > max) {
-                    max = m;
-                    parent = l;
+    vector<pair<State, Score>> row;
+    _row.reserve(_names.size() + 1);
+    _row.push_back(0);
+    for (const auto& name: _names) {
+        row.clear();
+        auto r = hmm.a.find(name);
+        if (r != hmm.a.end()) {
+            for (const auto& c: r->second) {
+                auto to = ids.find(c.first);
+                if (to != ids.end()) {
+                    row.emplace_back(to->second, Traits::from(c.second));
                 }
-                //cout << m << endl;
             }
+        }
 
-            v[i][j] = max;
-            parents[i][j] = parent;
+        sort(row.begin(), row.end(), [](const pair<State, Score>& x, 
+                    const pair<State, Score>& y) { return x.first < y.first; });
+        for (const auto& c: row) {
+            _col.push_back(c.first);
+            _val.push_back(c.second);
         }
+        _row.push_back(_col.size());
+    }
+}
 
-        st = st_next;
-        n_states = n_states_next;
+template<class S>
+bool CompiledHMM<S>::lookup(const vector<string>& py, vector<Obs>& ids) const
+{
+    ids.resize(py.size());
+    for (size_t i = 0; i < py.size(); i++) {
+        auto o = _obs_ids.find(py[i]);
+        if (o == _obs_ids.end()) return false;
+        ids[i] = o->second;
     }
+    return true;
+}
 
-    double max = -1000.0;
-    int k = 0;
-    for (auto l = 0; l < n_states; l++) {
-        auto m = v[n_seq-1][l];
-        if (m > max) {
-            max = m;
-            k = l;
-        }
+template<class S>
+bool CompiledHMM<S>::trans(State from, State to, Score& s) const
+{
+    auto b = _col.begin() + _row[from], e = _col.begin() + _row[from+1];
+    auto c = lower_bound(b, e, to);
+    if (c == e || *c != to) return false;
+
+    s = _val[c - _col.begin()];
+    return true;
+}
+
+template<class S>
+Decoded CompiledHMM<S>::decode(const vector<string>& py) const
+{
+    Decoded res;
+    vector<Obs> obs;
+    vector<State> path;
+    if (!lookup(py, obs) || !viterbi(obs, *this, path)) {
+        return res;
     }
 
-    cout << "k = " << k << ", p: " << max << endl;
+    res.zi.reserve(path.size());
+    for (auto s: path) {
+        res.zi.push_back(&_names[s]);
+    }
+    return res;
+}
+
+template class CompiledHMM<double>;
+template class CompiledHMM<float>;
+template class CompiledHMM<int32_t>;
+
+size_t Decoded::utf8_len() const
+{
+    size_t n = 0;
+    for (auto z: zi) {
+        n += z->size();
+    }
+    return n;
+}
+
+int Decoded::write_utf8(char* buf, int len) const
+{
+    size_t n = utf8_len();
+    if (len <= 0 || n + 1 > (size_t)len) return -1;
+
+    char* p = buf;
+    for (auto z: zi) {
+        memcpy(p, z->data(), z->size());
+        p += z->size();
+    }
+    *p = 0;
+    return n + 1;
+}
+
+string Decoded::str() const
+{
+    string s;
+    s.reserve(utf8_len());
+    for (auto z: zi) {
+        s += *z;
+    }
+    return s;
+}
 
-    res[n_seq-1] = st[k];
-    for (auto t = n_seq-2; t >= 0; t--) {
-        k = parents[t+1][k];
-        res[t] = _hmm_get_zi(hmm, obs[t])[k];
+// HMM: initial probabilities, transfer matrix, emission matrix,
+// output probabilities
+Decoded viterbi_decode(const vector<string>& obs, const HMM& hmm)
+{
+    Decoded res;
+    HMMModel model(hmm, &obs);
+
+    double max = 0.0;
+    if (!viterbi(obs, model, res.zi, &max)) {
+        return res;
     }
 
+    cout << "p: " << max << ", " << res.str() << endl;
+    return res;
+}
+
+vector<string> viterbi(const vector<string>& obs, const HMM& hmm)
+{
+    auto d = viterbi_decode(obs, hmm);
 
-    cout << res << endl;
+    vector<string> res;
+    res.reserve(d.zi.size());
+    for (auto z: d.zi) {
+        res.push_back(*z);
+    }
     return res;
 }
 
@@ -141,13 +254,32 @@ int test_viterbi()
         {"F", {{"normal", 0.1}, {"cold", 0.3}, {"dizzy", 0.6}}},
     };
 
-    vector<string> obs {"normal", "cold", "dizzy"};
-    viterbi(obs, hmm); // H, H, F
+    CompiledHMM<double> dm(hmm);
+    CompiledHMM<float> fm(hmm);
+    QuantizedHMM qm(hmm);
+
+    auto check = [&](const vector<string>& obs, const string& expect) {
+        auto a = viterbi_decode(obs, hmm).str(), b = dm.decode(obs).str(),
+             c = fm.decode(obs).str(), d = qm.decode(obs).str();
+        if (a != expect || b != expect || c != expect || d != expect) {
+            cerr << "viterbi mismatch: " << a << " " << b << " " << c << " " 
+                << d << ", expect " << expect << endl;
+            return 1;
+        }
+        return 0;
+    };
+
+    int err = 0;
+    err += check({"normal", "cold", "dizzy"}, "HHF");
+    err += check({"normal", "normal", "cold", "cold", "dizzy", "cold", "dizzy", 
+            "dizzy", "dizzy", "normal"}, "HHHHFFFFFH");
 
-    obs = {"normal", "normal", "cold", "cold", "dizzy", "cold", "dizzy", "dizzy", "dizzy", "normal"};
-    viterbi(obs, hmm); // H H H H F F F F F H
+    return err;
+}
 
-    return 0;
 }
 
+int dime_hmm_write_utf8(char *buf, int len, void *decoded)
+{
+    return static_cast<const dime::Decoded*>(decoded)->write_utf8(buf, len);
 }
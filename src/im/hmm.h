@@ -1,9 +1,24 @@
 #ifndef _DIME_HMM_H
 #define _DIME_HMM_H 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* C ABI, compatible with DimeTextWriter: copies the UTF-8 text of a 
+ * decoded sentence (a dime::Decoded*) into buf, returns bytes written 
+ * including the trailing NUL or -1 if it does not fit. */
+int dime_hmm_write_utf8(char *buf, int len, void *decoded);
+
+#ifdef __cplusplus
+}
+
 #include <unordered_map>
 #include <string>
 #include <vector>
+#include <iosfwd>
+
+#include "viterbi.h"
 
 
 namespace dime
@@ -19,7 +34,123 @@ namespace dime
         Matrix emission; // emission matrix
     };
 
-    vector<string> viterbi(const vector<string>& obs, HMM& hmm);
+    /* result of a decode. each entry points at a state name owned by the
+     * model (keys of HMM::emission), no string is copied, so it keeps valid 
+     * only as long as the model it's decoded from. */
+    struct Decoded {
+        vector<const string*> zi;
+
+        bool empty() const { return zi.empty(); }
+        size_t utf8_len() const;
+        int write_utf8(char* buf, int len) const;
+        string str() const;
+    };
+
+    /* string keyed access policy over HMM, this is the reference model. 
+     * only emitters of the given observations are indexed when obs is set. */
+    class HMMModel {
+    public:
+        typedef const string* State;
+        typedef string Obs;
+        typedef double Score;
+
+        explicit HMMModel(const HMM& hmm, const vector<string>* obs = nullptr);
+
+        const vector<Emitter<State, Score>>& emitters(const Obs& o) const;
+        bool trans(State from, State to, Score& s) const;
+        Score floor() const { return -1000.0; }
+
+    private:
+        const HMM& _hmm;
+        unordered_map<string, vector<Emitter<State, Score>>> _by_obs;
+    };
+
+    /* HMM compiled into integer ids: state names are interned once, 
+     * emitters are indexed by syllable id and transitions are stored as 
+     * sorted rows (CSR), so decoding needs no hashing at all. 
+     * Score can be double, float or a fixed-point integer (see ScoreTraits).
+     */
+    template<class S>
+    class CompiledHMM {
+    public:
+        typedef uint32_t State;
+        typedef uint32_t Obs;
+        typedef S Score;
+
+        explicit CompiledHMM(const HMM& hmm);
+
+        /* map pinyin syllables to observation ids, false if any is unknown */
+        bool lookup(const vector<string>& py, vector<Obs>& ids) const;
+        Decoded decode(const vector<string>& py) const;
+
+        const vector<Emitter<State, Score>>& emitters(Obs o) const { return _emitters[o]; }
+        bool trans(State from, State to, Score& s) const;
+        Score floor() const { return ScoreTraits<Score>::from(-1000.0); }
+
+        bool known(const string& py) const { return _obs_ids.count(py) > 0; }
+        const string& name(State s) const { return _names[s]; }
+        size_t n_states() const { return _names.size(); }
+        size_t memory() const; // estimated bytes in use
+
+    private:
+        vector<string> _names; // interned state names
+        unordered_map<string, Obs> _obs_ids;
+        vector<vector<Emitter<State, Score>>> _emitters; // indexed by Obs
+
+        vector<uint32_t> _row; // transitions of state s are [_row[s], _row[s+1])
+        vector<State> _col;
+        vector<Score> _val;
+    };
+
+    using QuantizedHMM = CompiledHMM<int32_t>;
+
+    extern template class CompiledHMM<double>;
+    extern template class CompiledHMM<float>;
+    extern template class CompiledHMM<int32_t>;
+
+    /* loads starting, transition and emission tables from a sqlite 
+     * database in parallel, returns an empty model on failure */
+    HMM load_hmm(const char* filepath);
+
+    /* estimated memory used by one table, including its hidden parts */
+    struct TableStats {
+        size_t entries;
+        size_t buckets;
+        float load_factor;
+        size_t bytes;     // nodes, values and bucket arrays
+        size_t overhead;  // bucket arrays + node links, cached hashes and malloc headers
+        size_t key_bytes; // heap storage of key strings (not inlined by SSO)
+    };
+
+    struct MemoryReport {
+        TableStats pi;
+        TableStats a;         // outer table, rows keyed by previous state
+        TableStats a_rows;    // all transition rows summed up
+        TableStats emission;
+        TableStats emission_rows;
+
+        size_t string_bytes;    // total heap storage of key strings
+        size_t duplicate_bytes; // storage of keys repeated in other rows/tables
+        size_t total;
+        size_t compiled; // CompiledHMM::memory() of the same model, 0 if unknown
+    };
+
+    MemoryReport memory_report(const HMM& hmm);
+    ostream& operator<<(ostream& os, const MemoryReport& r);
+
+    /* drops states that can never be decoded (no emission) from pi and 
+     * transitions, removes empty rows and rehashes every table down to its 
+     * size. returns number of entries and empty rows removed. keys are left
+     * as they are, CompiledHMM is what interns them. */
+    size_t compact(HMM& hmm);
+
+    Decoded viterbi_decode(const vector<string>& obs, const HMM& hmm);
+    vector<string> viterbi(const vector<string>& obs, const HMM& hmm);
+
+    /* decodes the toy model with every instantiation, 0 if all agree */
+    int test_viterbi();
 }
 
+#endif
+
 #endif /* ifndef _DIME_HMM_H */
@@ -0,0 +1,200 @@
+#include "hmm.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+namespace dime
+{
+
+/* size of a malloc chunk: one size_t header, 16 bytes aligned */
+static inline size_t _chunk(size_t n)
+{
+    return (n + sizeof(size_t) + 15) & ~(size_t)15;
+}
+
+/* heap held by a string, zero if it fits in the small string buffer */
+static inline size_t _heap(const string& s)
+{
+    auto p = s.data();
+    if (p >= (const char*)&s && p < (const char*)(&s + 1)) return 0;
+    return _chunk(s.capacity() + 1);
+}
+
+template<class Map>
+static TableStats _stats(const Map& m)
+{
+    using Value = typename Map::value_type;
+
+    TableStats t = {};
+    t.entries = m.size();
+    t.buckets = m.bucket_count();
+    t.load_factor = m.load_factor();
+
+    // a node holds the link, the value and the cached hash of a string key
+    size_t node = _chunk(sizeof(void*) + sizeof(Value) + sizeof(size_t));
+    size_t buckets = m.bucket_count() > 1 ? _chunk(m.bucket_count() * sizeof(void*)) : 0;
+    t.bytes = m.size() * node + buckets;
+    t.overhead = t.bytes - m.size() * sizeof(Value);
+
+    for (const auto& p: m) {
+        t.key_bytes += _heap(p.first);
+    }
+    return t;
+}
+
+static void _sum(TableStats& sum, const TableStats& t)
+{
+    sum.entries += t.entries;
+    sum.buckets += t.buckets;
+    sum.bytes += t.bytes;
+    sum.overhead += t.overhead;
+    sum.key_bytes += t.key_bytes;
+    sum.load_factor = sum.buckets ? (float)sum.entries / sum.buckets : 0.0f;
+}
+
+MemoryReport memory_report(const HMM& hmm)
+{
+    MemoryReport r = {};
+    unordered_map<string, size_t> seen;
+    auto count = [&](const string& s) {
+        if (seen[s]++) r.duplicate_bytes += s.size();
+    };
+
+    r.pi = _stats(hmm.pi);
+    for (const auto& p: hmm.pi) count(p.first);
+
+    r.a = _stats(hmm.a);
+    for (const auto& p: hmm.a) {
+        count(p.first);
+        _sum(r.a_rows, _stats(p.second));
+        for (const auto& q: p.second) count(q.first);
+    }
+
+    r.emission = _stats(hmm.emission);
+    for (const auto& p: hmm.emission) {
+        count(p.first);
+        _sum(r.emission_rows, _stats(p.second));
+        for (const auto& q: p.second) count(q.first);
+    }
+
+    r.string_bytes = r.pi.key_bytes + r.a.key_bytes + r.a_rows.key_bytes +
+        r.emission.key_bytes + r.emission_rows.key_bytes;
+    for (const auto& s: hmm.states) {
+        r.string_bytes += _heap(s);
+    }
+
+    r.total = r.pi.bytes + r.a.bytes + r.a_rows.bytes + r.emission.bytes +
+        r.emission_rows.bytes + hmm.states.capacity() * sizeof(string) + r.string_bytes;
+    return r;
+}
+
+static ostream& _print(ostream& os, const char* name, const TableStats& t)
+{
+    return os << setw(14) << left << name << right
+        << setw(9) << t.entries << " entries, "
+        << setw(9) << t.buckets << " buckets, lf " << fixed << setprecision(2) << t.load_factor << ", "
+        << setw(8) << t.bytes / 1024 << " KiB (overhead " << t.overhead / 1024 << " KiB)" << endl;
+}
+
+ostream& operator<<(ostream& os, const MemoryReport& r)
+{
+    _print(os, "pi", r.pi);
+    _print(os, "transition", r.a);
+    _print(os, "  rows", r.a_rows);
+    _print(os, "emission", r.emission);
+    _print(os, "  rows", r.emission_rows);
+
+    os << "strings: " << r.string_bytes / 1024 << " KiB on heap, "
+        << r.duplicate_bytes / 1024 << " KiB of repeated key text" << endl
+        << "total: " << r.total / 1024 << " KiB" << endl;
+    if (r.compiled) {
+        os << "compiled: " << r.compiled / 1024 << " KiB, keys interned, "
+            << ((int64_t)r.total - (int64_t)r.compiled) / 1024 << " KiB saved" << endl;
+    }
+    return os;
+}
+
+size_t compact(HMM& hmm)
+{
+    size_t removed = 0;
+    auto decodable = [&](const string& s) { return hmm.emission.count(s) > 0; };
+
+    for (auto r = hmm.emission.begin(); r != hmm.emission.end();) {
+        if (r->second.empty()) {
+            r = hmm.emission.erase(r);
+            removed++;
+            continue;
+        }
+        r->second.rehash(0);
+        ++r;
+    }
+
+    for (auto i = hmm.pi.begin(); i != hmm.pi.end();) {
+        if (!decodable(i->first)) {
+            i = hmm.pi.erase(i);
+            removed++;
+        } else {
+            ++i;
+        }
+    }
+
+    for (auto r = hmm.a.begin(); r != hmm.a.end();) {
+        auto& row = r->second;
+        if (decodable(r->first)) {
+            for (auto i = row.begin(); i != row.end();) {
+                if (!decodable(i->first)) {
+                    i = row.erase(i);
+                    removed++;
+                } else {
+                    ++i;
+                }
+            }
+        }
+
+        if (!decodable(r->first) || row.empty()) {
+            removed += row.size();
+            r = hmm.a.erase(r);
+            continue;
+        }
+
+        row.rehash(0);
+        ++r;
+    }
+
+    hmm.pi.rehash(0);
+    hmm.a.rehash(0);
+    hmm.emission.rehash(0);
+    hmm.states.shrink_to_fit();
+    return removed;
+}
+
+template<class S>
+size_t CompiledHMM<S>::memory() const
+{
+    size_t n = _names.capacity() * sizeof(string);
+    for (const auto& s: _names) {
+        n += _heap(s);
+    }
+
+    auto ids = _stats(_obs_ids);
+    n += ids.bytes + ids.key_bytes;
+
+    n += _emitters.capacity() * sizeof(_emitters[0]);
+    for (const auto& e: _emitters) {
+        n += _chunk(e.capacity() * sizeof(e[0]));
+    }
+
+    n += _row.capacity() * sizeof(_row[0]) + _col.capacity() * sizeof(_col[0]) +
+        _val.capacity() * sizeof(_val[0]);
+    return n;
+}
+
+template size_t CompiledHMM<double>::memory() const;
+template size_t CompiledHMM<float>::memory() const;
+template size_t CompiledHMM<int32_t>::memory() const;
+
+}
@@ -0,0 +1,140 @@
+#include "hmm.h"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <cstring>
+
+#include <sqlite3.h>
+
+using namespace std;
+
+namespace dime
+{
+
+/* every table is loaded by its own thread through its own connection */
+static sqlite3* _open(const char* filepath)
+{
+    sqlite3* db = nullptr;
+    int rc = sqlite3_open_v2(filepath, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (rc != SQLITE_OK) {
+        cerr << "open " << filepath << " failed: " << sqlite3_errstr(rc) << endl;
+        sqlite3_close(db);
+        return nullptr;
+    }
+    return db;
+}
+
+static sqlite3_stmt* _prepare(sqlite3* db, const char* sql)
+{
+    sqlite3_stmt* st = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &st, nullptr) != SQLITE_OK) {
+        cerr << "prepare [" << sql << "] failed: " << sqlite3_errmsg(db) << endl;
+        return nullptr;
+    }
+    return st;
+}
+
+static size_t _count(sqlite3* db, const char* sql)
+{
+    size_t n = 0;
+    sqlite3_stmt* st = _prepare(db, sql);
+    if (st && sqlite3_step(st) == SQLITE_ROW) {
+        n = sqlite3_column_int64(st, 0);
+    }
+    sqlite3_finalize(st);
+    return n;
+}
+
+/* column text is only valid until next step, it is copied into reused key
+ * buffers which allocate only when a new key gets inserted. */
+static inline void _column(sqlite3_stmt* st, int col, string& s)
+{
+    auto text = (const char*)sqlite3_column_text(st, col);
+    s.assign(text ? text : "", sqlite3_column_bytes(st, col));
+}
+
+static bool _load_table(const char* filepath, Table& t, const char* count_sql, const char* sql)
+{
+    sqlite3* db = _open(filepath);
+    if (!db) return false;
+
+    t.reserve(_count(db, count_sql));
+
+    sqlite3_stmt* st = _prepare(db, sql);
+    string key;
+    int rc = SQLITE_ERROR;
+    while (st && (rc = sqlite3_step(st)) == SQLITE_ROW) {
+        _column(st, 0, key);
+        t[key] = sqlite3_column_double(st, 1);
+    }
+
+    bool ok = st && rc == SQLITE_DONE;
+    sqlite3_finalize(st);
+    sqlite3_close(db);
+    return ok;
+}
+
+static bool _load_matrix(const char* filepath, Matrix& m, const char* count_sql, const char* sql)
+{
+    sqlite3* db = _open(filepath);
+    if (!db) return false;
+
+    m.reserve(_count(db, count_sql));
+
+    sqlite3_stmt* st = _prepare(db, sql);
+    string row_key, key;
+    Table* row = nullptr;
+    int rc = SQLITE_ERROR;
+    while (st && (rc = sqlite3_step(st)) == SQLITE_ROW) {
+        auto text = (const char*)sqlite3_column_text(st, 0);
+        size_t len = sqlite3_column_bytes(st, 0);
+        // rows of the same key tend to come in runs
+        if (!row || row_key.size() != len || memcmp(row_key.data(), text, len) != 0) {
+            row_key.assign(text ? text : "", len);
+            row = &m[row_key];
+        }
+
+        _column(st, 1, key);
+        (*row)[key] = sqlite3_column_double(st, 2);
+    }
+
+    bool ok = st && rc == SQLITE_DONE;
+    sqlite3_finalize(st);
+    sqlite3_close(db);
+    return ok;
+}
+
+HMM load_hmm(const char* filepath)
+{
+    HMM hmm;
+    bool ok_pi = false, ok_a = false, ok_e = false;
+
+    thread pi([&] {
+        ok_pi = _load_table(filepath, hmm.pi,
+                "select count(*) from starting",
+                "select character,probability from starting");
+    });
+
+    thread a([&] {
+        ok_a = _load_matrix(filepath, hmm.a,
+                "select count(distinct previous) from transition",
+                "select previous,behind,probability from transition");
+    });
+
+    ok_e = _load_matrix(filepath, hmm.emission,
+            "select count(distinct character) from emission",
+            "select emission.character, emission.pinyin, emission.probability + starting.probability "
+            "from emission join starting on emission.character = starting.character");
+
+    pi.join();
+    a.join();
+
+    if (!ok_pi || !ok_a || !ok_e) {
+        cerr << "load " << filepath << " failed" << endl;
+        return HMM();
+    }
+    return hmm;
+}
+
+}
@@ -0,0 +1,111 @@
+#include "prewarm.h"
+
+#include <glib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+namespace dime
+{
+
+/* mapped by prefault_dir, and whether they have locked pages */
+struct Mapping {
+    void* addr;
+    size_t size;
+    bool locked;
+};
+
+static vector<Mapping> _mapped;
+
+static size_t _prefault(const char* path, bool lock)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+
+    // reading all of it ahead would leave nothing to tell what is used
+    if (!lock) madvise(p, st.st_size, MADV_WILLNEED);
+    _mapped.push_back({p, (size_t)st.st_size, false});
+    return st.st_size;
+}
+
+size_t prefault_dir(const char* dir, bool lock)
+{
+    GDir* d = g_dir_open(dir, 0, NULL);
+    if (!d) return 0;
+
+    size_t n = 0;
+    const gchar* name;
+    while ((name = g_dir_read_name(d)) != NULL) {
+        gchar* path = g_build_filename(dir, name, NULL);
+        n += _prefault(path, lock);
+        g_free(path);
+    }
+    g_dir_close(d);
+    return n;
+}
+
+size_t resident_prefaulted(bool lock)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t n = 0;
+    bool failed = false; /* past RLIMIT_MEMLOCK, the rest would fail too */
+    for (auto& m: _mapped) {
+        size_t pages = (m.size + page - 1) / page;
+        vector<unsigned char> vec(pages);
+        // since linux 5.2 this is only true for files the process may
+        // write, others read as all resident
+        if (mincore(m.addr, m.size, vec.data()) < 0) continue;
+
+        size_t i = 0;
+        while (i < pages) {
+            if (!(vec[i] & 1)) {
+                i++;
+                continue;
+            }
+
+            size_t from = i;
+            while (i < pages && (vec[i] & 1)) i++;
+            size_t len = min(i * page, m.size) - from * page;
+            if (!lock) {
+                n += len;
+            } else if (!failed && mlock((char*)m.addr + from * page, len) == 0) {
+                m.locked = true;
+                n += len;
+            } else if (!failed) {
+                cerr << "mlock: " << strerror(errno) << endl;
+                failed = true;
+            }
+        }
+    }
+    return n;
+}
+
+void release_prefaulted()
+{
+    for (const auto& m: _mapped) {
+        if (m.locked) munlock(m.addr, m.size);
+        munmap(m.addr, m.size);
+    }
+    _mapped.clear();
+}
+
+}
@@ -0,0 +1,22 @@
+#ifndef _DIME_PREWARM_H
+#define _DIME_PREWARM_H 
+
+#include <stddef.h>
+
+namespace dime
+{
+    /* maps every regular file in dir and asks the kernel to read it ahead
+     * (MADV_WILLNEED) so the first lookups do not wait for the disk. with 
+     * lock nothing is read ahead, the pages a warmup brings in are what
+     * resident_prefaulted() locks. the files stay mapped until 
+     * release_prefaulted(). returns bytes mapped. */
+    size_t prefault_dir(const char* dir, bool lock);
+
+    /* bytes of the prefaulted files in memory now, as mincore() tells. with
+     * lock these pages are mlock'ed and stay resident until 
+     * release_prefaulted(), and only the bytes locked are counted. */
+    size_t resident_prefaulted(bool lock);
+    void release_prefaulted();
+}
+
+#endif /* ifndef _DIME_PREWARM_H */
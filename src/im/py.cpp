@@ -5,7 +5,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
 
+#include <glib.h>
 #include <pinyin.h>
 
 #include "py.h"
@@ -14,30 +16,296 @@
     fprintf(stderr, "%s" #fmt "\n", __func__, ##__VA_ARGS__); \
 } while (0)
 
+/* composition state of one input context */
+typedef struct PYSession {
+    uint32_t token; /* 0 if free */
+    guint64 last_used;
+    gboolean current; /* on some thread, so it is not evicted */
+
+    pinyin_instance_t * py_instance;
+
+    char parsed[256]; /* CodeInput as of last parse */
+    size_t parsed_len; /* bytes of parsed consumed by libpinyin */
+    guint n_cand;
+
+    struct _EIM eim;
+} PYSession;
+
+/* learning is appended to a journal on commit, the journal is synced 
+ * every PY_JOURNAL_SYNC seconds and folded into the user dictionary by
+ * pinyin_save every PY_SNAPSHOT seconds once input has been idle for 
+ * PY_SNAPSHOT_IDLE seconds. all of it happens off the main loop. */
+#define PY_JOURNAL_SYNC 2
+#define PY_SNAPSHOT 60
+#define PY_SNAPSHOT_IDLE 1
+#define PY_REPLAY_SCAN 64 /* candidates searched for a journaled phrase */
+
 static struct PYContext {
     pinyin_context_t *py_ctx;
-    pinyin_instance_t * py_instance;
+    int users; /* PY_Init calls not yet matched by PY_Destroy */
+
+    PYSession sessions[PY_SESSION_MAX]; /* preallocated, reused LRU */
+    GMutex sessions_lock; /* guards sessions, not the state inside them */
+    guint64 tick;
+
+    GMutex lock; /* guards py_ctx: decoding, training and saving */
+
+    char *journal_path;
+    int journal_fd;
+    gint journal_pending; /* appended but not synced */
+    gint trained; /* learned since last save */
+    gint last_input; /* seconds, monotonic */
+
+    GThread *snapshot;
+    GMutex snapshot_lock;
+    GCond snapshot_cond;
+    gboolean quit;
 } CTX;
 
-struct _EIM EIM;
+/* engine threads work on different sessions at the same time, each one on
+ * its own current session */
+static __thread PYSession *cur = NULL;
+static GMutex init_lock;
+
+#define SES (cur)
+
+struct _EIM* PY_GetEIM(void)
+{
+    return &SES->eim;
+}
+
+static void SessionClear(PYSession *ses)
+{
+    pinyin_reset(ses->py_instance);
+    ses->parsed[0] = 0;
+    ses->parsed_len = 0;
+    ses->n_cand = 0;
+    memset(&ses->eim, 0, sizeof(ses->eim));
+    ses->eim.CandWordMax = 10;
+}
+
+static int Now(void)
+{
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/* caller holds CTX.lock */
+static void JournalAppend(const char *pinyin, const char *phrase)
+{
+    if (CTX.journal_fd < 0)
+        return;
+
+    char rec[sizeof(EIM.CodeInput) + sizeof(EIM.StringGet) + 2];
+    int n = snprintf(rec, sizeof rec, "%s\t%s\n", pinyin, phrase);
+    if (n <= 0 || n >= (int)sizeof rec || write(CTX.journal_fd, rec, n) != n) {
+        TRACE("journal write failed");
+        return;
+    }
+    g_atomic_int_set(&CTX.journal_pending, 1);
+}
+
+/* caller holds CTX.lock */
+static gboolean Train(pinyin_instance_t *inst, int index, const char *expect)
+{
+    lookup_candidate_t *candidate = NULL;
+    const char *word = NULL;
+    if (!pinyin_get_candidate(inst, index, &candidate))
+        return FALSE;
 
-int PY_Init(const char *arg)
+    if (expect && (!pinyin_get_candidate_string(inst, candidate, &word) || strcmp(word, expect) != 0))
+        return FALSE;
+
+    pinyin_choose_candidate(inst, 0, candidate);
+    pinyin_train(inst);
+    return TRUE;
+}
+
+/* caller holds CTX.lock */
+static void Snapshot(void)
+{
+    g_atomic_int_set(&CTX.trained, 0);
+    if (!pinyin_save(CTX.py_ctx)) {
+        g_atomic_int_set(&CTX.trained, 1);
+        return;
+    }
+
+    /* everything journaled so far is in the dictionary now */
+    if (CTX.journal_fd >= 0 && ftruncate(CTX.journal_fd, 0) == 0)
+        g_atomic_int_set(&CTX.journal_pending, 0);
+}
+
+/* trains what was committed after the last save, i.e before a crash */
+static void JournalReplay(pinyin_instance_t *inst)
+{
+    FILE *fp = fopen(CTX.journal_path, "r");
+    if (!fp)
+        return;
+
+    int n = 0;
+    char line[sizeof(EIM.CodeInput) + sizeof(EIM.StringGet) + 2];
+    while (fgets(line, sizeof line, fp)) {
+        char *phrase = strchr(line, '\t');
+        if (!phrase)
+            continue;
+        *phrase++ = 0;
+        phrase[strcspn(phrase, "\n")] = 0;
+
+        pinyin_parse_more_full_pinyins(inst, line);
+        pinyin_guess_sentence_with_prefix(inst, "");
+        pinyin_guess_full_pinyin_candidates(inst, 0);
+
+        guint len = 0;
+        pinyin_get_n_candidate(inst, &len);
+        for (guint i = 0; i < len && i < PY_REPLAY_SCAN; i++) {
+            if (Train(inst, i, phrase)) {
+                n++;
+                break;
+            }
+        }
+        pinyin_reset(inst);
+    }
+    fclose(fp);
+
+    TRACE("replayed %d", n);
+    if (n > 0)
+        Snapshot();
+}
+
+static gpointer SnapshotLoop(gpointer data)
+{
+    int last_save = Now();
+
+    g_mutex_lock(&CTX.snapshot_lock);
+    while (!CTX.quit) {
+        gint64 deadline = g_get_monotonic_time() + PY_JOURNAL_SYNC * G_USEC_PER_SEC;
+        if (g_cond_wait_until(&CTX.snapshot_cond, &CTX.snapshot_lock, deadline) || CTX.quit)
+            continue;
+        g_mutex_unlock(&CTX.snapshot_lock);
+
+        if (g_atomic_int_get(&CTX.journal_pending)) {
+            g_atomic_int_set(&CTX.journal_pending, 0);
+            fdatasync(CTX.journal_fd);
+        }
+
+        int now = Now();
+        if (g_atomic_int_get(&CTX.trained) && now - last_save >= PY_SNAPSHOT &&
+                now - g_atomic_int_get(&CTX.last_input) >= PY_SNAPSHOT_IDLE) {
+            g_mutex_lock(&CTX.lock);
+            Snapshot();
+            g_mutex_unlock(&CTX.lock);
+            last_save = now;
+        }
+
+        g_mutex_lock(&CTX.snapshot_lock);
+    }
+    g_mutex_unlock(&CTX.snapshot_lock);
+    return NULL;
+}
+
+int PY_Init(const char *datadir, const char *userdir)
 {
     TRACE();
-    CTX.py_ctx = pinyin_init("/usr/lib/x86_64-linux-gnu/libpinyin/data", "/home/sonald/.yong/data");
+    g_mutex_lock(&init_lock);
+    if (CTX.users++ > 0) {
+        g_mutex_unlock(&init_lock);
+        return 0;
+    }
+
+    CTX.py_ctx = pinyin_init(datadir, userdir);
+    if (!CTX.py_ctx) {
+        CTX.users = 0;
+        g_mutex_unlock(&init_lock);
+        return -1;
+    }
 
     pinyin_option_t options = PINYIN_CORRECT_ALL | USE_DIVIDED_TABLE | USE_RESPLIT_TABLE | DYNAMIC_ADJUST;
     pinyin_set_options(CTX.py_ctx, options);
-    CTX.py_instance = pinyin_alloc_instance(CTX.py_ctx);
 
-    memset(&EIM, 0, sizeof(EIM));
-    EIM.CandWordMax = 10;
+    for (int i = 0; i < PY_SESSION_MAX; i++) {
+        PYSession *ses = &CTX.sessions[i];
+        memset(ses, 0, sizeof(*ses));
+        ses->py_instance = pinyin_alloc_instance(CTX.py_ctx);
+        SessionClear(ses);
+    }
+    g_mutex_init(&CTX.sessions_lock);
+
+    g_mutex_init(&CTX.lock);
+    CTX.journal_path = g_build_filename(userdir, "user.journal", NULL);
+    CTX.journal_fd = open(CTX.journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (CTX.journal_fd < 0)
+        TRACE("can not open %s, learning won't survive a crash", CTX.journal_path);
+    JournalReplay(CTX.sessions[0].py_instance);
+
+    g_mutex_init(&CTX.snapshot_lock);
+    g_cond_init(&CTX.snapshot_cond);
+    CTX.quit = FALSE;
+    CTX.snapshot = g_thread_new("py-snapshot", SnapshotLoop, NULL);
+    g_mutex_unlock(&init_lock);
     return 0;
 }
 
 void PY_Reset(void)
 {
     TRACE();
+    SessionClear(SES);
+}
+
+int PY_SelectSession(uint32_t token)
+{
+    PYSession *found = NULL, *victim = NULL;
+
+    g_mutex_lock(&CTX.sessions_lock);
+    if (cur)
+        cur->current = FALSE;
+
+    for (int i = 0; i < PY_SESSION_MAX; i++) {
+        PYSession *ses = &CTX.sessions[i];
+        if (ses->token == token) {
+            found = ses;
+            break;
+        }
+
+        /* sessions current on other threads are in use */
+        if (ses->current)
+            continue;
+        if (!victim || ses->token == 0 ||
+                (victim->token != 0 && ses->last_used < victim->last_used))
+            victim = ses;
+    }
+
+    int resumed = found != NULL;
+    if (!found) {
+        /* there are fewer engine threads than sessions */
+        g_assert(victim != NULL);
+        TRACE("evict %u for %u", victim->token, token);
+        SessionClear(victim);
+        victim->token = token;
+        found = victim;
+    }
+
+    found->last_used = ++CTX.tick;
+    found->current = TRUE;
+    cur = found;
+    g_mutex_unlock(&CTX.sessions_lock);
+    return resumed;
+}
+
+void PY_ReleaseSession(uint32_t token)
+{
+    g_mutex_lock(&CTX.sessions_lock);
+    for (int i = 0; i < PY_SESSION_MAX; i++) {
+        PYSession *ses = &CTX.sessions[i];
+        if (ses->token != token || (ses->current && ses != cur))
+            continue;
+
+        SessionClear(ses);
+        ses->last_used = 0;
+        /* selected on this thread until it picks another one, meanwhile it 
+         * keeps the dead token so no other thread takes it for token 0 */
+        if (ses != cur)
+            ses->token = 0;
+    }
+    g_mutex_unlock(&CTX.sessions_lock);
 }
 
 static int CloudMoveCaretTo(int key)
@@ -63,65 +331,163 @@ static int CloudMoveCaretTo(int key)
 	return 0;
 }
 
+/* length of common prefix of the last parsed input and the current one */
+static size_t ChangedPos(void)
+{
+    size_t i = 0;
+    while (SES->parsed[i] && SES->parsed[i] == EIM.CodeInput[i])
+        i++;
+    return i;
+}
+
+/* re-parses and re-guesses only when the input changed within the part 
+ * libpinyin consumed, candidate strings are fetched per page on request. */
 int PY_GetCandWords(int mode)
 {
     TRACE();
 
-    pinyin_parse_more_full_pinyins(CTX.py_instance, EIM.CodeInput);
-    pinyin_guess_sentence_with_prefix(CTX.py_instance, "");
-    pinyin_guess_full_pinyin_candidates(CTX.py_instance, 0);
+    size_t pos = ChangedPos();
+    if (SES->parsed[pos] == 0 && EIM.CodeInput[pos] == 0) {
+        return 0;
+    }
+
+    g_mutex_lock(&CTX.lock);
+    size_t parsed = pinyin_parse_more_full_pinyins(SES->py_instance, EIM.CodeInput);
+    gboolean dirty = pos < SES->parsed_len || parsed != SES->parsed_len;
+
+    strcpy(SES->parsed, EIM.CodeInput);
+    SES->parsed_len = parsed;
+    if (!dirty) {
+        /* only the unparsed tail changed, keys are the same */
+        g_mutex_unlock(&CTX.lock);
+        return 0;
+    }
+
+    pinyin_guess_sentence_with_prefix(SES->py_instance, "");
+    pinyin_guess_full_pinyin_candidates(SES->py_instance, 0);
 
     guint len = 0;
-    pinyin_get_n_candidate(CTX.py_instance, &len);
+    pinyin_get_n_candidate(SES->py_instance, &len);
+    g_mutex_unlock(&CTX.lock);
 
-    EIM.CandWordCount = MIN(len, EIM.CandWordMax);
+    SES->n_cand = len;
+    EIM.CandWordCount = MIN(len, (guint)EIM.CandWordMax);
     EIM.CandPageCount = len / EIM.CandWordMax + (len % EIM.CandWordMax > 0);
+    EIM.CurCandPage = 0;
 
-    for (size_t i = 0; i < EIM.CandWordCount; ++i) {
-        lookup_candidate_t * candidate = NULL;
-        pinyin_get_candidate(CTX.py_instance, i, &candidate);
+    const char* word = PY_GetCandWord(0);
+    strcpy(EIM.StringGet, word ? word : "");
 
-        const char* word = NULL;
-        pinyin_get_candidate_string(CTX.py_instance, candidate, &word);
-        if (i == 0) {
-            strcpy(EIM.StringGet, word);
-        }
-        printf("%s\t", word);
-    }
+    return 0;
+}
+
+int PY_Commit(int index)
+{
+    TRACE();
+
+    char text[sizeof(EIM.StringGet)];
+    const char *word = PY_GetCandWord(index);
+    g_strlcpy(text, word ? word : EIM.StringGet, sizeof text);
 
-    printf("\n");
+    g_mutex_lock(&CTX.lock);
+    if (word && Train(SES->py_instance, index, NULL)) {
+        JournalAppend(EIM.CodeInput, text);
+        g_atomic_int_set(&CTX.trained, 1);
+    }
+    g_mutex_unlock(&CTX.lock);
 
-    //pinyin_train(CTX.py_instance);
-    //pinyin_reset(CTX.py_instance);
-    //pinyin_save(CTX.py_ctx);
+    SessionClear(SES);
+    strcpy(EIM.StringGet, text);
     return 0;
 }
 
+const char* PY_GetCandWord(int index)
+{
+    if (index < 0 || (guint)index >= SES->n_cand)
+        return NULL;
+
+    /* strings come from the context, which another thread may be training */
+    lookup_candidate_t * candidate = NULL;
+    const char* word = NULL;
+    g_mutex_lock(&CTX.lock);
+    if (!pinyin_get_candidate(SES->py_instance, index, &candidate) ||
+            !pinyin_get_candidate_string(SES->py_instance, candidate, &word))
+        word = NULL;
+    g_mutex_unlock(&CTX.lock);
+    return word;
+}
+
+int PY_GetCandPage(int page, const char **words)
+{
+    if (page < 0 || page >= EIM.CandPageCount)
+        return 0;
+
+    int n = 0;
+    for (int i = page * EIM.CandWordMax; n < EIM.CandWordMax; i++, n++) {
+        if ((words[n] = PY_GetCandWord(i)) == NULL)
+            break;
+    }
+
+    EIM.CurCandPage = page;
+    EIM.CandWordCount = n;
+    return n;
+}
+
 int PY_Destroy(void)
 {
     TRACE();
+    g_mutex_lock(&init_lock);
+    if (CTX.users == 0 || --CTX.users > 0) {
+        g_mutex_unlock(&init_lock);
+        return 0;
+    }
 
-    pinyin_free_instance(CTX.py_instance);
-    CTX.py_instance = NULL;
+    for (int i = 0; i < PY_SESSION_MAX; i++) {
+        pinyin_free_instance(CTX.sessions[i].py_instance);
+        CTX.sessions[i].py_instance = NULL;
+        CTX.sessions[i].current = FALSE;
+    }
+    cur = NULL;
+
+    g_mutex_lock(&CTX.snapshot_lock);
+    CTX.quit = TRUE;
+    g_cond_signal(&CTX.snapshot_cond);
+    g_mutex_unlock(&CTX.snapshot_lock);
+    g_thread_join(CTX.snapshot);
+    CTX.snapshot = NULL;
 
     pinyin_mask_out(CTX.py_ctx, 0x0, 0x0);
-    pinyin_save(CTX.py_ctx);
+    Snapshot();
     pinyin_fini(CTX.py_ctx);
     CTX.py_ctx = NULL;
+
+    if (CTX.journal_fd >= 0)
+        close(CTX.journal_fd);
+    CTX.journal_fd = -1;
+    g_free(CTX.journal_path);
+    CTX.journal_path = NULL;
+
+    g_mutex_clear(&CTX.lock);
+    g_mutex_clear(&CTX.sessions_lock);
+    g_mutex_clear(&CTX.snapshot_lock);
+    g_cond_clear(&CTX.snapshot_cond);
+    g_mutex_unlock(&init_lock);
     return 0;
 }
 
-int PY_DoInput(int key)
+int PY_PushKey(int key)
 {
     TRACE("%c", key);
+    g_atomic_int_set(&CTX.last_input, Now());
     if (key >= 'a' && key <= 'z') {
+        if (EIM.CodeLen >= (int)sizeof(EIM.CodeInput) - 1)
+            return 0;
+
         EIM.CodeInput[EIM.CaretPos++] = key;
         EIM.CodeLen++;
         EIM.CodeInput[EIM.CodeLen] = 0;
         EIM.CaretPos = EIM.CodeLen;
-
-        PY_GetCandWords(0);
-        return 0;
+        return 1;
 
     } else if (key>='A' && key<='Z') {
 		if(EIM.CodeLen>=1)
@@ -130,3 +496,10 @@ int PY_DoInput(int key)
     return 0;
 }
 
+int PY_DoInput(int key)
+{
+    if (PY_PushKey(key)) {
+        PY_GetCandWords(0);
+    }
+    return 0;
+}
@@ -1,17 +1,44 @@
 #ifndef _DIME_PY_H
 #define _DIME_PY_H 
 
+#include <stdint.h>
 #include "config.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int PY_Init(const char *arg);
+/* datadir holds system dictionaries, userdir the user learning. every 
+ * PY_Init is matched by a PY_Destroy, the context is shared by them */
+int PY_Init(const char *datadir, const char *userdir);
 void PY_Reset(void);
 int PY_GetCandWords(int mode);
 int PY_Destroy(void);
 int PY_DoInput(int key);
+/* updates composition only, returns 1 if candidates need PY_GetCandWords */
+int PY_PushKey(int key);
+/* learns candidate index as the user's choice and starts a new 
+ * composition, StringGet keeps the committed text. learning is persisted 
+ * in background */
+int PY_Commit(int index);
+
+/* number of preallocated engine instances, input contexts beyond this
+ * reuse the least recently used one */
+#define PY_SESSION_MAX 8
+
+/* makes the session of token current on the calling thread, later calls 
+ * and EIM of this thread operate on it. threads can work on different 
+ * sessions in parallel, there must be fewer of them than PY_SESSION_MAX.
+ * returns 1 if an existing composition is resumed, 0 if a session gets 
+ * (re)started. */
+int PY_SelectSession(uint32_t token);
+/* drops the composition of token, its session is the first to be reused */
+void PY_ReleaseSession(uint32_t token);
+
+/* candidate strings are owned by the engine and keep valid until next input */
+const char* PY_GetCandWord(int index);
+/* fills words with at most CandWordMax candidates of page, returns count */
+int PY_GetCandPage(int page, const char **words);
 
 struct _EIM {
 	/* interface defined by platform */
@@ -19,13 +46,16 @@ struct _EIM {
 	int CodeLen;
 	int CandWordCount;
 	int CandPageCount;
+	int CurCandPage;
 	int CaretPos;
 	char CodeInput[256];
 	char StringGet[256];
 	
 };
 
-extern struct _EIM EIM;
+/* state of the current session */
+struct _EIM* PY_GetEIM(void);
+#define EIM (*PY_GetEIM())
 
 #ifdef __cplusplus
 }
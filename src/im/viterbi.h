@@ -0,0 +1,134 @@
+#ifndef _DIME_VITERBI_H
+#define _DIME_VITERBI_H
+
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+namespace dime
+{
+    using namespace std;
+
+    /* score arithmetic: floating point scores are log probabilities used as
+     * is, integral ones are fixed-point log probabilities with SHIFT
+     * fractional bits. */
+    template<class Score, class Enable = void>
+    struct ScoreTraits {
+        static Score from(double d) { return (Score)d; }
+        static double to(Score s) { return (double)s; }
+    };
+
+    template<class Score>
+    struct ScoreTraits<Score, typename enable_if<is_integral<Score>::value>::type> {
+        enum { SHIFT = 8 };
+        static Score from(double d) { return (Score)lround(d * (1 << SHIFT)); }
+        static double to(Score s) { return (double)s / (1 << SHIFT); }
+    };
+
+    /* a state which can emit some observation */
+    template<class State, class Score>
+    struct Emitter {
+        State state;
+        Score start; // initial prob + emission prob
+        Score emit;  // emission prob
+    };
+
+    /* Model is an access policy, it provides:
+     *
+     *   typedef ... State, Obs, Score;
+     *   const vector<Emitter<State, Score>>& emitters(const Obs& o) const;
+     *   bool trans(const State& from, const State& to, Score& s) const;
+     *   Score floor() const; // score of an impossible path
+     *
+     * everything is resolved at compile time, so the inner loop is plain
+     * array walking plus whatever trans() costs for the model.
+     * returns false if there is no path, prob gets the score of the best one.
+     */
+    template<class Model,
+        class State = typename Model::State,
+        class Obs = typename Model::Obs,
+        class Score = typename Model::Score>
+    bool viterbi(const vector<Obs>& obs, const Model& model, vector<State>& path,
+            Score* prob = nullptr)
+    {
+        using Emitters = vector<Emitter<State, Score>>;
+
+        path.clear();
+        size_t n_seq = obs.size();
+        if (n_seq == 0) return false;
+
+        // candidates of each step and where their back pointers start
+        vector<const Emitters*> steps(n_seq);
+        vector<size_t> offsets(n_seq);
+        size_t total = 0;
+        for (size_t t = 0; t < n_seq; t++) {
+            steps[t] = &model.emitters(obs[t]);
+            if (steps[t]->empty()) return false;
+            offsets[t] = total;
+            total += steps[t]->size();
+        }
+
+        const Score floor = model.floor();
+        vector<uint32_t> parents(total);
+        vector<Score> v, v_next;
+
+        const Emitters* st = steps[0];
+        v.resize(st->size());
+        for (size_t i = 0; i < st->size(); i++) {
+            v[i] = (*st)[i].start;
+        }
+
+        for (size_t t = 1; t < n_seq; t++) {
+            const Emitters* next = steps[t];
+            v_next.resize(next->size());
+            uint32_t *back = &parents[offsets[t]];
+
+            for (size_t j = 0; j < next->size(); j++) {
+                const auto& to = (*next)[j];
+
+                Score max = floor;
+                uint32_t parent = 0;
+                for (size_t l = 0; l < st->size(); l++) {
+                    Score a;
+                    if (!model.trans((*st)[l].state, to.state, a)) {
+                        continue;
+                    }
+
+                    Score m = v[l] + a + to.emit;
+                    if (m > max) {
+                        max = m;
+                        parent = l;
+                    }
+                }
+
+                v_next[j] = max;
+                back[j] = parent;
+            }
+
+            v.swap(v_next);
+            st = next;
+        }
+
+        Score max = floor;
+        uint32_t k = 0;
+        for (size_t l = 0; l < v.size(); l++) {
+            if (v[l] > max) {
+                max = v[l];
+                k = l;
+            }
+        }
+
+        path.resize(n_seq);
+        path[n_seq-1] = (*steps[n_seq-1])[k].state;
+        for (size_t t = n_seq-1; t > 0; t--) {
+            k = parents[offsets[t] + k];
+            path[t-1] = (*steps[t-1])[k].state;
+        }
+
+        if (prob) *prob = max;
+        return true;
+    }
+}
+
+#endif /* ifndef _DIME_VITERBI_H */
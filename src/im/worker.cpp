@@ -0,0 +1,96 @@
+#include "worker.h"
+
+#include <algorithm>
+
+#include "msg_queue.h"
+
+namespace dime
+{
+
+static Job _quit;
+
+Worker::Worker(Handler run, Handler reply, Engine* engine)
+    :_run(run), _reply(reply), _engine(engine), _stats()
+{
+    _queue = g_async_queue_new();
+    _thread = g_thread_new("engine", Worker::loop, this);
+}
+
+Worker::~Worker()
+{
+    g_async_queue_push(_queue, &_quit);
+    g_thread_join(_thread);
+    g_async_queue_unref(_queue);
+}
+
+void Worker::push(Job* job, bool supersede)
+{
+    job->owner = this;
+    job->type = MSG_INVALID;
+    {
+        lock_guard<mutex> l(_lock);
+        job->seq = supersede ? ++_latest[job->token] : _latest[job->token];
+    }
+    g_async_queue_push(_queue, job);
+}
+
+bool Worker::is_latest(const Job* job)
+{
+    lock_guard<mutex> l(_lock);
+    auto i = _latest.find(job->token);
+    return i != _latest.end() && i->second == job->seq;
+}
+
+void Worker::forget(uint32_t token)
+{
+    lock_guard<mutex> l(_lock);
+    _latest.erase(token);
+}
+
+WorkerStats Worker::stats()
+{
+    lock_guard<mutex> l(_lock);
+    return _stats;
+}
+
+void Worker::_count(const Job* job)
+{
+    gint64 delay = job->started - job->received;
+
+    int bucket = 0;
+    for (gint64 d = delay / 100; d > 0 && bucket < WORKER_DELAY_HIST - 1; d >>= 1) {
+        bucket++;
+    }
+
+    lock_guard<mutex> l(_lock);
+    _stats.jobs++;
+    _stats.delay_total += delay;
+    _stats.delay_max = max(_stats.delay_max, delay);
+    _stats.delays[bucket]++;
+}
+
+gpointer Worker::loop(gpointer data)
+{
+    Worker* w = (Worker*)data;
+
+    Job* job;
+    while ((job = (Job*)g_async_queue_pop(w->_queue)) != &_quit) {
+        job->started = g_get_monotonic_time();
+        w->_count(job);
+        w->_run(w, job);
+        // at the priority of the I/O watches, an idle source would wait
+        // until the main loop has nothing else to do
+        g_idle_add_full(G_PRIORITY_DEFAULT, Worker::deliver, job, NULL);
+    }
+    return NULL;
+}
+
+gboolean Worker::deliver(gpointer data)
+{
+    Job* job = (Job*)data;
+    job->owner->_reply(job->owner, job);
+    delete job;
+    return FALSE;
+}
+
+}
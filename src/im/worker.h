@@ -0,0 +1,94 @@
+#ifndef _DIME_WORKER_H
+#define _DIME_WORKER_H 
+
+#include <glib.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace dime
+{
+    using namespace std;
+
+    class Worker;
+    class Engine;
+
+    /* a run of keystrokes of one input context, only the last one can be a
+     * commit */
+    struct Job {
+        Worker* owner;
+        uint32_t token;
+        uint32_t seq; /* assigned by Worker::push, increasing per token */
+        uint32_t ack; /* seq of the client's last key, acked by the reply */
+        vector<int> keys;
+        gint64 received; /* monotonic time the key arrived */
+        gint64 started; /* monotonic time the engine took it */
+
+        int page = -1; /* asked for, -1 for keys */
+        bool report = false; /* asks for Engine::report in text instead */
+        bool release = false; /* the token is gone, drops its session */
+        bool warmup = false; /* decodes common syllables, text tells how long */
+
+        /* filled by engine: MSG_COMMIT, MSG_PREEDIT, MSG_CANDIDATES or 
+         * MSG_INVALID if there is nothing to reply */
+        int8_t type;
+        string text;
+        vector<string> candidates; /* of page, or of the first one after keys */
+        int page_count = 0;
+    };
+
+#define WORKER_DELAY_HIST 8
+
+    /* time jobs spent queued, from received to started */
+    struct WorkerStats {
+        uint64_t jobs;
+        gint64 delay_total; /* us */
+        gint64 delay_max;
+        uint64_t delays[WORKER_DELAY_HIST]; /* < 100us, < 200us, < 400us, ... */
+    };
+
+    /* runs engine work off the main loop. jobs are handled in order, and
+     * a job is stale once a newer one of the same token has been pushed, 
+     * so handlers can skip decoding it and drop its reply.
+     *
+     * there can be several workers, each with an engine of its own. a token
+     * always goes to the same one, so its jobs still run in order. */
+    class Worker {
+    public:
+        using Handler = void (*)(Worker*, Job*);
+
+        /* run is called on the worker thread, reply on the main loop */
+        Worker(Handler run, Handler reply, Engine* engine = nullptr);
+        ~Worker();
+
+        Engine* engine() const { return _engine; }
+        WorkerStats stats();
+
+        /* main loop only, takes ownership of job. a job which does not 
+         * supersede leaves the ones before it latest */
+        void push(Job* job, bool supersede = true);
+        bool is_latest(const Job* job);
+        /* main loop only, once the last job of a released token is back */
+        void forget(uint32_t token);
+
+    private:
+        static gpointer loop(gpointer data);
+        static gboolean deliver(gpointer data);
+
+        void _count(const Job* job);
+
+        Handler _run, _reply;
+        Engine* _engine; /* only used on the worker thread */
+        GThread* _thread;
+        GAsyncQueue* _queue;
+
+        mutex _lock;
+        unordered_map<uint32_t, uint32_t> _latest; /* token -> seq */
+        WorkerStats _stats;
+    };
+}
+
+#endif /* ifndef _DIME_WORKER_H */